@@ -9,11 +9,30 @@ SOURCES += \
     csapp.c \
     proxy.c \
     cache.c \
+    event.c \
+    sbuf.c \
+    upstream.c \
+    park.c \
+    http.c \
+    dns.c \
+    disk.c \
+    refresh.c \
+    metrics.c \
     Test.c
 
 HEADERS += \
     csapp.h \
-    cache.h
+    cache.h \
+    proxy.h \
+    event.h \
+    sbuf.h \
+    upstream.h \
+    park.h \
+    http.h \
+    dns.h \
+    disk.h \
+    refresh.h \
+    metrics.h
 
 OTHER_FILES += \
     proxy.log
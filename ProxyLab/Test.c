@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     // memfd_create
+
 #include "csapp.h"
 #include "cache.h"
 
@@ -36,3 +38,1018 @@ int main()
 }
 
 #endif
+
+#ifdef RIO_BENCH
+
+/*
+ * Line reader microbenchmark, build with
+ *     gcc -O2 -DRIO_BENCH Test.c csapp.c dns.c -pthread
+ * Reads the same request headers from a memfd with the byte at a time
+ * loop rio_readlineb used to have, with rio_readlineb and with rio_getlineb
+ */
+
+#define BENCH_ROUNDS 20000
+
+static const char *bench_req =
+    "GET http://www.cmu.edu/index.html HTTP/1.1\r\n"
+    "Host: www.cmu.edu\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// rio_read as it was, one byte per call from the line loop
+static ssize_t byte_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;
+    if ((size_t)rp->rio_cnt < n)
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t byte_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; (size_t)n < maxlen; n++) {
+        if ((rc = byte_read(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n')
+                break;
+        } else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            else
+                break;
+        } else
+            return -1;
+    }
+    *bufp = 0;
+    return n;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read all lines of fd with method m, return ns per line
+static double bench(int fd, int m, long *bytes_p)
+{
+    rio_t rio;
+    char buf[MAXLINE], *line;
+    long lines = 0, bytes = 0;
+    ssize_t n;
+    double t;
+
+    lseek(fd, 0, SEEK_SET);
+    rio_readinitb(&rio, fd);
+    t = now_sec();
+    while (1)
+    {
+        if (m == 0)
+            n = byte_readlineb(&rio, buf, MAXLINE);
+        else if (m == 1)
+            n = rio_readlineb(&rio, buf, MAXLINE);
+        else
+            n = rio_getlineb(&rio, &line);
+        if (n <= 0)
+            break;
+        lines++;
+        bytes += (m == 0) ? (ssize_t)strlen(buf) : n;
+    }
+    t = now_sec() - t;
+    *bytes_p = bytes;
+    return t * 1e9 / lines;
+}
+
+int main()
+{
+    static const char *names[] = {"byte loop", "rio_readlineb", "rio_getlineb"};
+    int fd = memfd_create("rio-bench", 0), i, m;
+    size_t len = strlen(bench_req);
+    long bytes;
+
+    for (i = 0; i < BENCH_ROUNDS; i++)
+        Rio_writen(fd, (void *)bench_req, len);
+
+    for (m = 0; m < 3; m++)
+    {
+        bench(fd, m, &bytes);   // warm up page cache
+        printf("%-14s %6.1f ns/line (%ld bytes)\n", names[m], bench(fd, m, &bytes), bytes);
+    }
+    return 0;
+}
+
+#endif
+
+#if defined(HTTP_BENCH) || defined(HTTP_FUZZ)
+#include "http.h"
+
+static const char *http_samples[] = {
+    "GET http://www.cmu.edu/index.html HTTP/1.1\r\n"
+    "Host: www.cmu.edu\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n",
+    "GET /a/b?c=d HTTP/1.0\r\nHost: [::1]:8080\r\nConnection: close, TE\r\n\r\n",
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Fri, 16 Oct 2026 22:17:51 GMT\r\n"
+    "Content-Type: text/html; charset=utf-8\r\n"
+    "Content-Length: 20020\r\n"
+    "Connection: keep-alive\r\n"
+    "Keep-Alive: timeout=5\r\n"
+    "\r\n",
+    "HTTP/1.0 304\nTransfer-Encoding: gzip, chunked\n\n",
+};
+#define HTTP_NSAMPLES (sizeof(http_samples) / sizeof(http_samples[0]))
+
+static int parse_all(const char *buf, int len, int type, http_msg_t *m)
+{
+    http_init(m, type);
+    return http_parse(m, buf, len);
+}
+#endif
+
+#ifdef HTTP_BENCH
+
+/*
+ * HTTP head parser benchmark, build with
+ *     gcc -O2 -DHTTP_BENCH Test.c http.c csapp.c dns.c -pthread
+ * Compares http_parse on a whole head and on a head arriving 16 bytes at a
+ * time with what the proxy used to do: sscanf of the request line, a
+ * strstr/strncpy split of the url and a strncasecmp of every header line
+ */
+
+#define BENCH_ROUNDS 1000000
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int old_parse(const char *req)
+{
+    char method[MAXLINE], url[MAXLINE], version[MAXLINE], host[MAXLINE], path[MAXLINE];
+    const char *line, *eol, *p;
+    int csize = -1;
+
+    if(sscanf(req, "%s %s %s", method, url, version) != 3)
+        return -1;
+    p = strstr(url + 7, "/");
+    strncpy(host, url + 7, p - url - 7);
+    host[p - url - 7] = '\0';
+    strcpy(path, p);
+
+    line = strstr(req, "\r\n") + 2;
+    while((eol = strstr(line, "\r\n")) != NULL && eol != line)
+    {
+        if(!strncasecmp(line, "Content-Length:", 15))
+            csize = atoi(line + 15);
+        else if(!strncasecmp(line, "Connection:", 11) && strcasestr(line, "close"))
+            csize = -2;
+        line = eol + 2;
+    }
+    return csize + strlen(host) + strlen(path);
+}
+
+int main()
+{
+    const char *req = http_samples[0];
+    int len = strlen(req), i, n, sink = 0;
+    http_msg_t m;
+    double t;
+
+    t = now_sec();
+    for(i = 0; i < BENCH_ROUNDS; i++)
+        sink += old_parse(req);
+    printf("sscanf+strstr  %6.1f ns/head\n", (now_sec() - t) * 1e9 / BENCH_ROUNDS);
+
+    t = now_sec();
+    for(i = 0; i < BENCH_ROUNDS; i++)
+        sink += parse_all(req, len, HTTP_REQUEST, &m) + m.nheaders;
+    printf("http_parse     %6.1f ns/head\n", (now_sec() - t) * 1e9 / BENCH_ROUNDS);
+
+    t = now_sec();
+    for(i = 0; i < BENCH_ROUNDS; i++)
+    {
+        http_init(&m, HTTP_REQUEST);
+        for(n = 16; http_parse(&m, req, n < len ? n : len) == HTTP_AGAIN; n += 16)
+            ;
+        sink += m.nheaders;
+    }
+    printf("http_parse/16B %6.1f ns/head (%d bytes, %d)\n", (now_sec() - t) * 1e9 / BENCH_ROUNDS, len, sink & 1);
+    return 0;
+}
+
+#endif
+
+#ifdef HTTP_FUZZ
+
+/*
+ * HTTP head parser fuzz test, build with
+ *     gcc -g -fsanitize=address,undefined -DHTTP_FUZZ Test.c http.c csapp.c dns.c -pthread
+ * Mutates the samples at random and parses each result twice: whole, and
+ * fed in random pieces through a buffer that moves between calls. Both must
+ * agree, spans must lie inside the head, and the sanitizers must stay quiet
+ * since every buffer is exactly as long as its data
+ */
+
+#define FUZZ_ROUNDS 200000
+
+static int fuzz_mutate(char *buf, int len, int cap)
+{
+    static const char *tokens[] = {"\r\n", "\n", ":", " ", "\t", "http://", "[", "]", "@",
+                                   "Content-Length: ", "Connection: close", "99999", ","};
+    int i, k, pos, n;
+
+    for(k = rand() % 4; k >= 0; k--)
+    {
+        pos = len ? rand() % len : 0;
+        switch(rand() % 4)
+        {
+        case 0:     // flip a byte
+            if(len)
+                buf[pos] = rand() % 256;
+            break;
+        case 1:     // drop a run
+            n = rand() % 8;
+            if(pos + n > len)
+                n = len - pos;
+            memmove(buf + pos, buf + pos + n, len - pos - n);
+            len -= n;
+            break;
+        default:    // insert a token
+            i = rand() % (sizeof(tokens) / sizeof(tokens[0]));
+            n = strlen(tokens[i]);
+            if(len + n > cap)
+                break;
+            memmove(buf + pos + n, buf + pos, len - pos);
+            memcpy(buf + pos, tokens[i], n);
+            len += n;
+            break;
+        }
+    }
+    return len;
+}
+
+static void check_span(http_span_t s, int head_len)
+{
+    if(s.off < 0 || s.len < 0 || s.off + s.len > head_len)
+    {
+        fprintf(stderr, "span %d+%d outside head of %d\n", s.off, s.len, head_len);
+        abort();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static http_msg_t whole, piece;
+    char src[4096], *buf, *moving;
+    int round, len, type, rc1, rc2, got, n, i, done = 0;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for(round = 0; round < FUZZ_ROUNDS; round++)
+    {
+        i = rand() % HTTP_NSAMPLES;
+        type = !strncmp(http_samples[i], "HTTP/", 5) ? HTTP_RESPONSE : HTTP_REQUEST;
+        len = strlen(http_samples[i]);
+        memcpy(src, http_samples[i], len);
+        len = fuzz_mutate(src, len, sizeof(src));
+
+        buf = malloc(len ? len : 1);
+        memcpy(buf, src, len);
+        rc1 = parse_all(buf, len, type, &whole);
+
+        // Same bytes in random pieces, buffer moves every time
+        http_init(&piece, type);
+        moving = NULL;
+        for(got = 0, rc2 = HTTP_AGAIN; rc2 == HTTP_AGAIN && got < len; )
+        {
+            n = 1 + rand() % (len - got);
+            free(moving);
+            moving = malloc(got + n);
+            memcpy(moving, src, got + n);
+            got += n;
+            rc2 = http_parse(&piece, moving, got);
+        }
+        free(moving);
+
+        if(rc1 != rc2 || (rc1 == HTTP_DONE && (whole.head_len != piece.head_len ||
+           whole.nheaders != piece.nheaders || whole.content_length != piece.content_length ||
+           whole.host.off != piece.host.off || whole.port != piece.port)))
+        {
+            fprintf(stderr, "round %d: whole %d, pieces %d on:\n%.*s\n", round, rc1, rc2, len, src);
+            abort();
+        }
+
+        if(rc1 == HTTP_DONE)
+        {
+            done++;
+            check_span(whole.method, whole.head_len);
+            check_span(whole.url, whole.head_len);
+            check_span(whole.host, whole.head_len);
+            check_span(whole.path, whole.head_len);
+            for(i = 0; i < whole.nheaders; i++)
+            {
+                check_span(whole.headers[i].line, whole.head_len);
+                check_span(whole.headers[i].value, whole.head_len);
+            }
+        }
+        free(buf);
+    }
+    printf("%d rounds, %d heads parsed, no disagreement\n", FUZZ_ROUNDS, done);
+    return 0;
+}
+
+#endif
+
+#ifdef CACHE_SIM
+
+/*
+ * Cache policy simulator, build with
+ *     gcc -O2 -DCACHE_SIM Test.c cache.c disk.c csapp.c dns.c -pthread -lm
+ * and run as ./a.out clock|slru [tinylfu]. Replays a Zipf distributed trace
+ * of objects of mixed sizes, broken up by scans of objects asked for only
+ * once, through Lookup_cache and Insert_cache and prints the hit ratios
+ */
+
+#define SIM_OBJECTS 5000
+#define SIM_REQUESTS 200000
+#define SIM_ALPHA 0.9
+#define SIM_SCAN_EVERY 20000    // requests between scans
+#define SIM_SCAN_LEN 2000       // one hit wonders per scan
+
+static unsigned long sim_seed = 88172645463325252ul;
+
+static unsigned long sim_rand()
+{
+    sim_seed ^= sim_seed << 13;
+    sim_seed ^= sim_seed >> 7;
+    sim_seed ^= sim_seed << 17;
+    return sim_seed;
+}
+
+// Size of object i, mostly small with a tail up to MAX_OBJECT_SIZE
+static int sim_size(unsigned long i)
+{
+    unsigned long h = i * 2654435761ul;
+
+    if(h % 10 < 7)
+        return 512 + h % 8192;
+    return 8192 + h % (MAX_OBJECT_SIZE - 8192);
+}
+
+static void sim_request(unsigned long i)
+{
+    static char body[MAX_OBJECT_SIZE];
+    char url[64];
+    cdata *p;
+    cchain c;
+    int size = sim_size(i);
+
+    sprintf(url, "http://sim/%lu", i);
+    if((p = Lookup_cache(url)) != NULL)
+    {
+        Release_cache(p);
+        return;
+    }
+    Chain_init(&c, size);
+    Chain_append(&c, body, size);
+    Insert_cache(url, &c, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    static double cdf[SIM_OBJECTS];
+    cache_stats_t st;
+    double sum = 0, u;
+    unsigned long scan = SIM_OBJECTS;
+    int i, j, lo, hi;
+    cache_conf_t conf = {
+        .policy = argv[1],
+        .tinylfu = argc > 2 && !strcmp(argv[2], "tinylfu"),
+        .capacity = MAX_CACHE_SIZE,
+        .max_object = MAX_OBJECT_SIZE,
+        .shards = CACHE_SHARDS,
+        .grace = 0,
+        .local = 0,
+    };
+
+    if(argc < 2 || Cache_init(&conf) == -1)
+    {
+        fprintf(stderr, "usage: %s clock|slru [tinylfu]\n", argv[0]);
+        return 1;
+    }
+
+    for(i = 0; i < SIM_OBJECTS; i++)
+        cdf[i] = (sum += 1.0 / pow(i + 1, SIM_ALPHA));
+
+    for(i = 0; i < SIM_REQUESTS; i++)
+    {
+        if(i % SIM_SCAN_EVERY == SIM_SCAN_EVERY - 1)
+            for(j = 0; j < SIM_SCAN_LEN; j++)
+                sim_request(scan++);
+
+        // Rank of next object, by binary search of cdf
+        u = (double)(sim_rand() >> 11) / (1ul << 53) * sum;
+        for(lo = 0, hi = SIM_OBJECTS - 1; lo < hi; )
+        {
+            j = (lo + hi) / 2;
+            if(cdf[j] < u)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        sim_request(lo);
+    }
+
+    Cache_stats(&st);
+    printf("%s%s: hit ratio %.3f, byte hit ratio %.3f, admitted %ld, rejected %ld, evicted %ld\n",
+           st.policy, st.tinylfu ? "+tinylfu" : "",
+           (double)st.hits / (st.hits + st.misses),
+           (double)st.hit_bytes / (st.hit_bytes + st.miss_bytes),
+           st.admitted, st.rejected, st.evicted);
+    return 0;
+}
+
+#endif
+
+#ifdef CHAIN_FUZZ
+
+/*
+ * Cache buffer chain test, build with
+ *     gcc -g -fsanitize=address,undefined -DCHAIN_FUZZ Test.c cache.c disk.c csapp.c dns.c -pthread
+ * Builds chains with Chain_append and Chain_insert at random positions,
+ * favoring the ends of full buffers, and checks every buffer stays within
+ * CACHE_CHUNK and the bytes match a flat copy built alongside
+ */
+
+#define CHAIN_ROUNDS 500
+#define CHAIN_MAX (3 * CACHE_CHUNK)
+
+static void chain_check(cchain *c, char *flat, long len, int round)
+{
+    long off = 0;
+    int i;
+
+    for(i = 0; i < c->n; i++)
+    {
+        if(c->lens[i] < 0 || c->lens[i] > CACHE_CHUNK || off + c->lens[i] > len ||
+           memcmp(c->bufs[i], flat + off, c->lens[i]))
+        {
+            fprintf(stderr, "round %d: buffer %d of %ld bytes at %ld is wrong\n",
+                    round, i, c->lens[i], off);
+            abort();
+        }
+        off += c->lens[i];
+    }
+    if(off != len || c->size != len)
+    {
+        fprintf(stderr, "round %d: chain has %ld bytes (size %ld), expected %ld\n",
+                round, off, c->size, len);
+        abort();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *flat = malloc(CHAIN_MAX), *src = malloc(CACHE_CHUNK);
+    long len, pos, n, base;
+    int round, op, i, inserts = 0;
+    cchain c;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for(round = 0; round < CHAIN_ROUNDS; round++)
+    {
+        Chain_init(&c, CHAIN_MAX);
+        for(len = 0, op = rand() % 16; op >= 0; op--)
+        {
+            n = rand() % 4 ? rand() % 4096 : rand() % CACHE_CHUNK + 1;
+            if(len + n > CHAIN_MAX)
+                break;
+            for(i = 0; i < n; i++)
+                src[i] = rand();
+
+            if(len == 0 || rand() % 2)
+                pos = len;
+            else
+            {
+                // Near the end of a buffer, full ones included, or anywhere
+                pos = rand() % (len + 1);
+                if(rand() % 2)
+                {
+                    for(base = 0, i = 0; i < c.n - 1 && base + c.lens[i] <= pos; i++)
+                        base += c.lens[i];
+                    pos = base + c.lens[i] - rand() % 64;
+                    if(pos < 0)
+                        pos = 0;
+                }
+                inserts++;
+            }
+
+            if((pos == len ? Chain_append(&c, src, n) : Chain_insert(&c, pos, src, n)) == -1)
+            {
+                fprintf(stderr, "round %d: %ld bytes at %ld of %ld failed\n", round, n, pos, len);
+                abort();
+            }
+            memmove(flat + pos + n, flat + pos, len - pos);
+            memcpy(flat + pos, src, n);
+            len += n;
+            chain_check(&c, flat, len, round);
+        }
+        Chain_free(&c);
+    }
+    printf("%d rounds, %d inserts, chains match\n", CHAIN_ROUNDS, inserts);
+    free(flat);
+    free(src);
+    return 0;
+}
+
+#endif
+
+#ifdef PROXY_BENCH
+
+#include <sys/resource.h>
+
+/*
+ * Proxy load generator, build with
+ *     gcc -O2 -DPROXY_BENCH Test.c csapp.c dns.c -pthread -lm
+ * and run against a proxy on this host as ./a.out [options] proxy_port.
+ * Serves its own origin on a loopback port, asks the proxy for Zipf
+ * distributed objects of that origin over keep-alive connections and
+ * prints throughput, latency percentiles, hit ratio and, given the pid of
+ * the proxy, its CPU time per request. A request is a hit when it never
+ * reaches the origin.
+ *
+ * With -r rate the load is open loop: connection i of c sends requests
+ * i, i + c, i + 2c... at their turn of a fixed schedule and latency counts
+ * from that turn, so time queued behind a slow response is not lost.
+ * Without, each connection sends again as soon as it has its answer
+ */
+
+#define LOAD_RANGE "bytes=0-1023"   // asked for by the -g share of requests
+
+static const char *load_usage =
+    "usage: %s [-c conns] [-n requests] [-w warmup] [-r rate] [-o objects] [-a alpha]\n"
+    "       [-u unique%%] [-g range%%] [-s size] [-l latency_ms] [-m max_age] [-p proxy_pid] proxy_port\n";
+
+// Origin
+static int origin_port, origin_size, origin_latency, origin_max_age = 3600;
+static char *origin_body;
+static atomic_long origin_fetches, origin_unchanged;
+
+// Driver
+static int proxy_port, load_conns = 16, load_objects = 10000, load_unique, load_range;
+static double load_rate, load_alpha = 0.9, load_start, *load_cdf;
+static atomic_ulong load_once;      // number of next object asked for only once
+
+typedef struct
+{
+    int id;
+    long count;             // requests to send
+    double *lat;            // seconds each took
+    long bytes, errors;
+    long retried;           // sent again, proxy had closed the connection
+    unsigned long seed;
+} load_t;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Size of object i: -s size, else mostly small with a tail up to MAX_OBJECT_SIZE
+static int object_size(unsigned long i)
+{
+    unsigned long h = i * 2654435761ul;
+
+    if(origin_size > 0)
+        return origin_size;
+    if(h % 10 < 7)
+        return 512 + h % 8192;
+    return 8192 + h % (MAX_OBJECT_SIZE - 8192);
+}
+
+// Write all of iov[0..n-1] to fd, return 0 or -1
+static int writev_full(int fd, struct iovec *iov, int n)
+{
+    ssize_t w;
+
+    while(n > 0)
+    {
+        if((w = writev(fd, iov, n)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        for(; n > 0 && w >= (ssize_t)iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if(n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Answer requests of one proxy connection. Any path ending in a number is
+// an object of that number, validated by an ETag of number and size.
+// Connection stays open unless the request says otherwise, HTTP/1.0 ones
+// by default
+static void *origin_conn(void *vargp)
+{
+    int fd = *(int *)vargp, size, match, keep;
+    char line[MAXLINE], path[MAXLINE], head[MAXLINE], etag[64], *num;
+    struct iovec iov[2];
+    unsigned long i;
+    rio_t rio;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, fd);
+    while(rio_readlineb(&rio, line, MAXLINE) > 0)
+    {
+        // eg: GET /obj/42 HTTP/1.1
+        if(sscanf(line, "%*s %s", path) != 1)
+            break;
+        i = strtoul((num = strrchr(path, '/')) ? num + 1 : path, NULL, 10);
+        size = object_size(i);
+        sprintf(etag, "\"%lu-%d\"", i, size);
+
+        keep = strstr(line, "HTTP/1.0") == NULL;
+        match = 0;
+        while(rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n"))
+        {
+            if(!strncasecmp(line, "If-None-Match:", 14) && strstr(line, etag))
+                match = 1;
+            else if(!strncasecmp(line, "Connection:", 11))
+                keep = strcasestr(line, "keep-alive") != NULL;
+        }
+
+        if(origin_latency > 0)
+            usleep(origin_latency * 1000);
+
+        iov[0].iov_base = head;
+        iov[1].iov_base = origin_body;
+        iov[1].iov_len = 0;
+        if(match)
+        {
+            iov[0].iov_len = sprintf(head, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                                     "Cache-Control: max-age=%d\r\n\r\n", etag, origin_max_age);
+            atomic_fetch_add(&origin_unchanged, 1);
+        }
+        else
+        {
+            iov[0].iov_len = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                     "Content-Length: %d\r\nETag: %s\r\nCache-Control: max-age=%d\r\n\r\n",
+                                     size, etag, origin_max_age);
+            iov[1].iov_len = size;
+            atomic_fetch_add(&origin_fetches, 1);
+        }
+        if(writev_full(fd, iov, 2) == -1 || !keep)
+            break;
+    }
+    Close(fd);
+    return NULL;
+}
+
+static void *origin_run(void *vargp)
+{
+    int listenfd = *(int *)vargp, *connfdp;
+    pthread_t tid;
+
+    while(1)
+    {
+        connfdp = Malloc(sizeof(int));
+        *connfdp = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, origin_conn, connfdp);
+    }
+    return NULL;
+}
+
+// Listen on a free port and serve it from a thread
+static void origin_start()
+{
+    static int listenfd;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+
+    origin_body = Malloc(origin_size > MAX_OBJECT_SIZE ? origin_size : MAX_OBJECT_SIZE);
+    memset(origin_body, 'x', origin_size > MAX_OBJECT_SIZE ? origin_size : MAX_OBJECT_SIZE);
+    if((listenfd = open_listenfd(0)) < 0)
+        unix_error("origin listen");
+    getsockname(listenfd, (SA *)&addr, &len);
+    origin_port = ntohs(addr.sin_port);
+    Pthread_create(&tid, NULL, origin_run, &listenfd);
+}
+
+static unsigned long load_rand(unsigned long *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Send next request of t on fd, with path and headers of the request mix
+static int load_send(load_t *t, int fd)
+{
+    char req[MAXLINE], path[64];
+    double u;
+    int lo, hi, j, len;
+
+    if((int)(load_rand(&t->seed) % 100) < load_unique)
+        sprintf(path, "/once/%lu", load_objects + atomic_fetch_add(&load_once, 1));
+    else
+    {
+        // Rank of object, by binary search of cdf
+        u = (double)(load_rand(&t->seed) >> 11) / (1ul << 53) * load_cdf[load_objects - 1];
+        for(lo = 0, hi = load_objects - 1; lo < hi; )
+        {
+            j = (lo + hi) / 2;
+            if(load_cdf[j] < u)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        sprintf(path, "/obj/%d", lo);
+    }
+
+    len = sprintf(req, "GET http://127.0.0.1:%d%s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n%s\r\n",
+                  origin_port, path, origin_port,
+                  (int)(load_rand(&t->seed) % 100) < load_range ? "Range: " LOAD_RANGE "\r\n" : "");
+    return rio_writen(fd, req, len) == len ? 0 : -1;
+}
+
+// Read a response, return its status, 0 if the connection was closed
+// before any or -1 if it broke. *close_p tells whether the connection is
+// done for
+static int load_response(rio_t *rio, long *bytes_p, int *close_p)
+{
+    char line[MAXLINE], buf[MAXLINE];
+    long len = -1, got = 0, n;
+    int status;
+
+    *close_p = 1;
+    if(rio_readlineb(rio, line, MAXLINE) <= 0)
+        return 0;
+    if(sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+    *close_p = 0;
+    while(rio_readlineb(rio, line, MAXLINE) > 0 && strcmp(line, "\r\n"))
+    {
+        if(!strncasecmp(line, "Content-Length:", 15))
+            len = atol(line + 15);
+        else if(!strncasecmp(line, "Connection:", 11) && strcasestr(line, "close"))
+            *close_p = 1;
+    }
+
+    // Without a length the body ends with the connection
+    if(len < 0 && status != 304 && status != 204)
+        *close_p = 1;
+    else if(len < 0)
+        len = 0;
+    while(len < 0 || got < len)
+    {
+        n = (len < 0 || len - got > MAXLINE) ? MAXLINE : len - got;
+        if((n = rio_readnb(rio, buf, n)) <= 0)
+            break;
+        got += n;
+    }
+    *bytes_p = got;
+    if(len >= 0 && got < len)
+    {
+        *close_p = 1;
+        return -1;
+    }
+    return status;
+}
+
+static void *load_thread(void *vargp)
+{
+    load_t *t = vargp;
+    int fd = -1, status, closed, used = 0, retry;
+    double start, due;
+    long k, bytes;
+    rio_t rio;
+
+    for(k = 0; k < t->count; k++)
+    {
+        start = now_sec();
+        if(load_rate > 0)
+        {
+            due = load_start + (k * load_conns + t->id) / load_rate;
+            if(due > start)
+                usleep((due - start) * 1e6);
+            start = due;
+        }
+
+        // A connection that served requests before may have been closed by
+        // proxy meanwhile, the request is sent again on a new one. That is
+        // reported apart: a proxy that keeps connections alive never does it
+        do
+        {
+            if(fd < 0)
+            {
+                if((fd = open_clientfd("127.0.0.1", proxy_port)) < 0)
+                {
+                    fprintf(stderr, "cannot connect to proxy on port %d\n", proxy_port);
+                    exit(1);
+                }
+                rio_readinitb(&rio, fd);
+                used = 0;
+            }
+            bytes = 0;
+            status = 0;
+            closed = 1;
+            if(load_send(t, fd) == 0)
+                status = load_response(&rio, &bytes, &closed);
+            retry = status == 0 && used > 0;
+            t->retried += retry;
+            if(closed)
+            {
+                Close(fd);
+                fd = -1;
+            }
+        } while(retry);
+        used++;
+        t->lat[k] = now_sec() - start;
+        if(status / 100 == 2)
+            t->bytes += bytes;
+        else
+            t->errors++;
+    }
+    if(fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+// Send n requests over load_conns connections, return seconds taken
+static double load_run(long n, load_t *ts)
+{
+    pthread_t tids[load_conns];
+    int i;
+
+    load_start = now_sec();
+    for(i = 0; i < load_conns; i++)
+    {
+        ts[i].id = i;
+        ts[i].count = n / load_conns + (i < n % load_conns);
+        ts[i].bytes = ts[i].errors = ts[i].retried = 0;
+        Pthread_create(&tids[i], NULL, load_thread, &ts[i]);
+    }
+    for(i = 0; i < load_conns; i++)
+        Pthread_join(tids[i], NULL);
+    return now_sec() - load_start;
+}
+
+// CPU seconds used by process pid so far, or -1
+static double cpu_sec(int pid)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    struct rusage ru;
+    FILE *fp;
+    int ok;
+
+    if(pid == 0)
+    {
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    }
+    sprintf(path, "/proc/%d/stat", pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    ok = fgets(buf, sizeof(buf), fp) != NULL && (p = strrchr(buf, ')')) != NULL &&
+         sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2;
+    fclose(fp);
+    return ok ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    long n = 20000, warmup = 0, bytes = 0, errors = 0, retried = 0, fetches, unchanged, k, m;
+    double sum = 0, t, proxy_cpu = -1, self_cpu, *lat;
+    int opt, pid = 0, i;
+    load_t *ts;
+
+    while((opt = getopt(argc, argv, "c:n:w:r:o:a:u:g:s:l:m:p:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c': load_conns = atoi(optarg); break;
+        case 'n': n = atol(optarg); break;
+        case 'w': warmup = atol(optarg); break;
+        case 'r': load_rate = atof(optarg); break;
+        case 'o': load_objects = atoi(optarg); break;
+        case 'a': load_alpha = atof(optarg); break;
+        case 'u': load_unique = atoi(optarg); break;
+        case 'g': load_range = atoi(optarg); break;
+        case 's': origin_size = atoi(optarg); break;
+        case 'l': origin_latency = atoi(optarg); break;
+        case 'm': origin_max_age = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        default: n = 0; break;
+        }
+    }
+    if(argc - optind != 1 || n <= 0 || warmup < 0 || load_conns <= 0 || load_objects <= 0 ||
+       load_rate < 0 || origin_size < 0 || origin_latency < 0)
+    {
+        fprintf(stderr, load_usage, argv[0]);
+        return 1;
+    }
+    proxy_port = atoi(argv[optind]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    load_cdf = Malloc(load_objects * sizeof(double));
+    for(i = 0; i < load_objects; i++)
+        load_cdf[i] = (sum += 1.0 / pow(i + 1, load_alpha));
+    ts = Calloc(load_conns, sizeof(load_t));
+    for(i = 0; i < load_conns; i++)
+    {
+        ts[i].seed = 88172645463325252ul + i * 2654435761ul;
+        ts[i].lat = Malloc((n > warmup ? n : warmup) / load_conns * sizeof(double) + sizeof(double));
+    }
+    origin_start();
+
+    if(warmup > 0)
+        load_run(warmup, ts);
+    origin_fetches = origin_unchanged = 0;
+    if(pid > 0)
+        proxy_cpu = cpu_sec(pid);
+    self_cpu = cpu_sec(0);
+    t = load_run(n, ts);
+    if(pid > 0 && proxy_cpu >= 0)
+        proxy_cpu = cpu_sec(pid) - proxy_cpu;
+    self_cpu = cpu_sec(0) - self_cpu;
+    fetches = origin_fetches;
+    unchanged = origin_unchanged;
+
+    lat = Malloc(n * sizeof(double));
+    for(i = 0, m = 0; i < load_conns; i++)
+    {
+        for(k = 0; k < ts[i].count; k++)
+            lat[m++] = ts[i].lat[k];
+        bytes += ts[i].bytes;
+        errors += ts[i].errors;
+        retried += ts[i].retried;
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+
+    printf("%ld requests over %d connections in %.2f s: %.0f req/s, %.1f MB/s, %ld errors, "
+           "%ld retried on closed connections\n", n, load_conns, t, n / t, bytes / t / 1e6, errors, retried);
+    printf("latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+           lat[n / 2] * 1e3, lat[(long)(n * 0.99)] * 1e3, lat[(long)(n * 0.999)] * 1e3, lat[n - 1] * 1e3);
+    printf("hit ratio %.3f: %ld origin fetches, %ld revalidated unchanged\n",
+           1 - (double)(fetches + unchanged) / n, fetches, unchanged);
+    if(proxy_cpu >= 0)
+        printf("proxy cpu %.1f us/request, ", proxy_cpu / n * 1e6);
+    printf("load generator and origin cpu %.1f us/request\n", self_cpu / n * 1e6);
+    return 0;
+}
+
+#endif
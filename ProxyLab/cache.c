@@ -1,205 +1,1327 @@
+#define _GNU_SOURCE     // memfd_create
+#include <limits.h>
+#include <sys/sendfile.h>
 #include "cache.h"
+#include "disk.h"
 
-static cdata *head, *rear;
-static sem_t qmutex;    // queue mutex
-static int tsize;       // total cache size
+// Header in front of the data of every cache buffer
+typedef struct
+{
+    int fd;             // backing memfd, -1 for a heap buffer
+    size_t maplen;      // length of mapping
+} cbuf_hdr;
+
+// Reader counters of one stripe, for even and odd epochs, and statistics
+// kept by the threads of the stripe
+typedef struct
+{
+    atomic_long n[2];
+    atomic_long hits, hit_bytes;
+    atomic_long misses, miss_bytes;
+    atomic_long disk_hits, disk_hit_bytes;
+    atomic_long revalidated, revalidated_bytes;
+} __attribute__((aligned(64))) cstripe;
+
+// Nodes of one list of a shard, in the order the policy keeps them
+typedef struct
+{
+    cdata *head, *rear;
+    int count;
+    long bytes;
+} clist;
+
+// Cache is split by url hash into shards, each with its own lock, hash
+// index, eviction lists and an equal share of capacity
+typedef struct
+{
+    sem_t qmutex;       // shard mutex, taken by writers only
+    cdata *_Atomic bucket[CACHE_BUCKETS];
+    clist seg[2];       // CLOCK: ring in seg[0]. SLRU: probation, protected
+    cdata *hand;        // CLOCK hand, next eviction candidate
+    long tsize;         // total cache size of shard
+    long index_bytes;   // memory of its nodes besides object bytes
+    long admitted, rejected, evicted;
+
+    atomic_ulong epoch;
+    cstripe readers[EPOCH_STRIPES];
+    cdata *retired;     // unlinked nodes waiting for readers to leave
+    cflight *flights;   // misses being fetched, guarded by qmutex
+
+    // TinyLFU frequency sketch of url hashes, 4 bit counters
+    atomic_uchar sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    atomic_int sketch_adds;
+} cshard;
+
+// Eviction policy. Readers never take the shard mutex, they only set the
+// referenced bit of a node: policies act on it when they look for a victim
+typedef struct
+{
+    char *name;
+    void (*add)(cshard *s, cdata *p);       // link a new node
+    void (*remove)(cshard *s, cdata *p);    // unlink a node
+    cdata *(*victim)(cshard *s);            // node to evict next, NULL if none
+    void (*restore)(cshard *s, cdata *p);   // relink a removed victim, last first
+} cpolicy;
+
+static void clock_add(cshard *s, cdata *p);
+static void clock_remove(cshard *s, cdata *p);
+static cdata *clock_victim(cshard *s);
+static void clock_restore(cshard *s, cdata *p);
+static void slru_add(cshard *s, cdata *p);
+static void slru_remove(cshard *s, cdata *p);
+static cdata *slru_victim(cshard *s);
+static void slru_restore(cshard *s, cdata *p);
 
+static cpolicy policies[] = {
+    {"clock", clock_add, clock_remove, clock_victim, clock_restore},
+    {"slru", slru_add, slru_remove, slru_victim, slru_restore},
+};
+
+static cshard *shards;
+static int nshards;
+static long shard_size;     // capacity of each shard
+static long max_object;
+static cpolicy *policy = &policies[0];
+static int tinylfu;     // admit a node only if it is more frequent than its victims
+static long grace;
+static int local;       // nodes go to the shard of the inserting thread
+static __thread int my_shard = -1;
+static atomic_int stripe_cnt;
+static __thread int my_stripe = -1;
+
+unsigned int hash_url(char *url);
+cshard *shard_of(unsigned int hash);
+static cshard *place_of(unsigned int hash);
 cdata *get_from_cache(char *url);
-int create_cache(cdata* acache);
-void delete_node(cdata *p);
-void add_to_rear(cdata *p);
+static cdata *find_node(cshard *s, unsigned int hash, char *url, int pin);
+cdata *new_node(char *url, cchain *c, cfresh *fr);
+static int buf_fd(char *ptr);
+static long node_overhead(cdata *p);
+int create_cache(cdata* acache, int replace);
+void evict_node(cshard *s, cdata *p);
+void delete_node(cshard *s, cdata *p);
+static void list_insert(clist *l, cdata *at, cdata *p);
+static void list_unlink(clist *l, cdata *p);
+static void sketch_add(cshard *s, unsigned int hash);
+static int sketch_freq(cshard *s, unsigned int hash);
+static int stripe();
+unsigned long epoch_enter(cshard *s);
+void epoch_exit(cshard *s, unsigned long e);
+void retire_node(cshard *s, cdata *p);
+void reclaim(cshard *s);
+void free_node(cdata *p);
+void shrink_buf(cbuf_hdr *hdr, long size);
+void leave_flight(cflight *f);
+
+
+int Cache_init(cache_conf_t *conf)
+{
+    int i;
+
+    for(i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+        if(!strcasecmp(policies[i].name, conf->policy))
+            break;
+    if(i == (int)(sizeof(policies) / sizeof(policies[0])))
+        return -1;
+    if(conf->shards <= 0 || conf->max_object <= 0 ||
+       conf->capacity / conf->shards < conf->max_object)
+        return -1;
+
+    policy = &policies[i];
+    tinylfu = conf->tinylfu;
+    nshards = conf->shards;
+    shard_size = conf->capacity / conf->shards;
+    max_object = conf->max_object;
+    grace = conf->grace;
+    local = conf->local;
+
+    if((shards = aligned_alloc(64, nshards * sizeof(cshard))) == NULL)
+        unix_error("aligned_alloc error");
+    memset(shards, 0, nshards * sizeof(cshard));
+    for(i = 0; i < nshards; i++)
+        Sem_init(&shards[i].qmutex, 0, 1);
+    return 0;
+}
+
+void Cache_local(int shard)
+{
+    my_shard = shard % nshards;
+}
 
+long Cache_max_object()
+{
+    return max_object;
+}
 
-void Cache_init()
+void Cache_stats(cache_stats_t *st)
 {
-    Sem_init(&qmutex, 0, 1);
-    tsize = 0;
-    head = NULL;
-    rear = NULL;
+    cshard *s;
+    int i, j;
+
+    memset(st, 0, sizeof(*st));
+    st->policy = policy->name;
+    st->tinylfu = tinylfu;
+    st->capacity = shard_size * nshards;
+    st->shard_capacity = shard_size;
+    st->table_bytes = nshards * sizeof(cshard);
+    for(i = 0; i < nshards; i++)
+    {
+        s = &shards[i];
+        for(j = 0; j < EPOCH_STRIPES; j++)
+        {
+            st->hits += atomic_load(&s->readers[j].hits);
+            st->hit_bytes += atomic_load(&s->readers[j].hit_bytes);
+            st->misses += atomic_load(&s->readers[j].misses);
+            st->miss_bytes += atomic_load(&s->readers[j].miss_bytes);
+            st->disk_hits += atomic_load(&s->readers[j].disk_hits);
+            st->disk_hit_bytes += atomic_load(&s->readers[j].disk_hit_bytes);
+            st->revalidated += atomic_load(&s->readers[j].revalidated);
+            st->revalidated_bytes += atomic_load(&s->readers[j].revalidated_bytes);
+        }
+
+        P(&s->qmutex);
+        st->objects += s->seg[0].count + s->seg[1].count;
+        st->bytes += s->tsize;
+        st->index_bytes += s->index_bytes;
+        st->admitted += s->admitted;
+        st->rejected += s->rejected;
+        st->evicted += s->evicted;
+        V(&s->qmutex);
+    }
 }
 
-int Get_cache(char *url, int browserfd)
+int Get_cache(char *url, int browserfd, cdata **stale_p)
 {
-    cdata *acache = get_from_cache(url);
+    cdata *acache = Lookup_cache(url);
+
+    int state;
+
+    if(stale_p)
+        *stale_p = NULL;
     if(acache == NULL)
         return UNCACHED;
 
-    // write to browser
-    rio_writen(browserfd, acache->cache, acache->size);
+    if((state = Cache_check(acache)) == CACHE_STALE)
+    {
+        // Without validators server can only send it all again
+        if(stale_p && (acache->etag || acache->last_modified))
+            *stale_p = acache;
+        else
+            Release_cache(acache);
+        return UNCACHED;
+    }
 
-    // Decrease reader number
-    P(&(acache->cmutex));
-    (acache->read_cnt)--;
-    V(&(acache->cmutex));
+    // write to browser
+    Write_cache(acache, browserfd);
+    if(state == CACHE_DUE && stale_p)
+        *stale_p = acache;
+    else
+    {
+        if(state == CACHE_DUE)
+            atomic_store(&acache->refreshing, 0);
+        Release_cache(acache);
+    }
     return CACHED;
 }
 
-int Insert_cache(char *url, char *ptr, int size)
+int Cache_fresh(cdata *acache)
 {
-    cdata *acache = (cdata *)malloc(sizeof(cdata));
-    int status;
+    return time(NULL) < atomic_load_explicit(&acache->expires, memory_order_relaxed);
+}
 
-    if(ptr == NULL)
+int Cache_check(cdata *acache)
+{
+    time_t now = time(NULL), expires = atomic_load_explicit(&acache->expires, memory_order_relaxed);
+    long life = atomic_load_explicit(&acache->lifetime, memory_order_relaxed), ahead;
+    int hot = grace > 0 && atomic_load_explicit(&acache->hits, memory_order_relaxed) >= CACHE_HOT_HITS;
+
+    // A strict node goes to server once expired, however hot
+    if(now >= expires && !(hot && now < expires + grace &&
+                           !atomic_load_explicit(&acache->strict, memory_order_relaxed)))
+        return CACHE_STALE;
+
+    // Ahead of expiry by a share of lifetime, so that a short lived node is
+    // not due again as soon as it was refreshed
+    if(life >= CACHE_REFRESH_AHEAD_MAX * 100 / CACHE_REFRESH_AHEAD)
+        ahead = CACHE_REFRESH_AHEAD_MAX;
+    else
+        ahead = life * CACHE_REFRESH_AHEAD / 100;
+    if(hot && now >= expires - ahead && !atomic_load(&acache->refreshing) &&
+       !atomic_exchange(&acache->refreshing, 1))
+        return CACHE_DUE;
+    return CACHE_FRESH;
+}
+
+void Cache_refresh(cdata *acache, long life, int strict)
+{
+    cshard *s = &shards[acache->shard];
+
+    atomic_store(&acache->lifetime, life);
+    atomic_store(&acache->strict, strict);
+    atomic_store(&acache->expires, time(NULL) + life);
+    atomic_fetch_add_explicit(&s->readers[stripe()].revalidated, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->readers[stripe()].revalidated_bytes, acache->size, memory_order_relaxed);
+}
+
+int Write_cache(cdata *acache, int fd)
+{
+    return Write_cache_range(acache, fd, 0, acache->size);
+}
+
+int Write_cache_range(cdata *acache, int fd, long off, long end)
+{
+    ssize_t n;
+
+    while(off < end)
+    {
+        n = Send_cache(acache, fd, &off, end);
+        if(n == 0 || (n < 0 && errno != EINTR))
+            return -1;
+    }
+    return 0;
+}
+
+ssize_t Send_cache(cdata *acache, int fd, long *off_p, long end)
+{
+    long base = 0, left;
+    char *chunk;
+    int i = 0, cfd;
+    ssize_t n;
+    off_t off;
+
+    // Bytes from *off_p to end of chunk holding it
+    while(*off_p >= base + acache->lens[i])
+        base += acache->lens[i++];
+    chunk = acache->chunks[i];
+    left = acache->lens[i] - (*off_p - base);
+    if(left > end - *off_p)
+        left = end - *off_p;
+
+    if((cfd = buf_fd(chunk)) >= 0)
+    {
+        off = CBUF_HDR + *off_p - base;
+        n = sendfile(fd, cfd, &off, left);
+    }
+    else
+        n = write(fd, chunk + *off_p - base, left);
+
+    if(n > 0)
+        *off_p += n;
+    return n;
+}
+
+cdata *Lookup_cache(char *url)
+{
+    cdata *p;
+    cchain c;
+    cfresh fr;
+    cstripe *st;
+
+    if((p = get_from_cache(url)) != NULL || !Disk_enabled())
+        return p;
+
+    // Found on disk: take object back into memory. It is pinned for caller
+    // even if admission keeps it out, then it goes once released. The miss
+    // counted in memory turns into a disk hit
+    if(Disk_load(url, &c, &fr) == -1)
+        return NULL;
+    p = new_node(url, &c, &fr);
+    st = &place_of(p->hash)->readers[stripe()];
+    atomic_fetch_sub_explicit(&st->misses, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->disk_hits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->disk_hit_bytes, p->size, memory_order_relaxed);
+    atomic_store(&p->refcnt, 2);
+    if(create_cache(p, 0) != CACHE_SUCCESS)
+        atomic_store(&p->refcnt, 1);
+    return p;
+}
+
+void Release_cache(cdata *acache)
+{
+    cshard *s;
+
+    // Drop reader reference, last one out frees an already unlinked node
+    if(atomic_fetch_sub(&acache->refcnt, 1) == 1)
+    {
+        s = &shards[acache->shard];
+        P(&s->qmutex);
+        retire_node(s, acache);
+        V(&s->qmutex);
+    }
+}
+
+int Insert_cache(char *url, cchain *c, cfresh *fr)
+{
+    cdata *acache;
+    cshard *s;
+    int status, disk = Disk_enabled();
+
+    if(c->bufs == NULL || c->n == 0)
+    {
+        Chain_free(c);
+        return -1;
+    }
+
+    acache = new_node(url, c, fr);
+    s = place_of(acache->hash);
+    atomic_fetch_add_explicit(&s->readers[stripe()].miss_bytes, acache->size, memory_order_relaxed);
+
+    // Disk writer holds a reference of its own, taken before readers can
+    // see the node and evict it
+    if(disk)
+        atomic_store(&acache->refcnt, 2);
+
+    status = create_cache(acache, 1);
+    if(status == CACHE_BY_OTHER)    // never visible to readers
+        free_node(acache);
+    else if(disk)
+    {
+        // Objects admission turned away still go to disk
+        if(status == CACHE_REJECTED)
+            atomic_store(&acache->refcnt, 1);
+        Disk_put(acache);
+    }
+    else if(status == CACHE_REJECTED)
+    {
+        free_node(acache);
         return -1;
+    }
+
+    return 0;
+}
+
+// Node for url with the response in chain c, which it adopts, fresh as fr
+// says. Buffers are trimmed, a small object is moved to the heap
+cdata *new_node(char *url, cchain *c, cfresh *fr)
+{
+    cdata *acache;
+    cbuf_hdr *hdr;
+    char *small;
+    int i;
+
+    for(i = 0; i < c->n; i++)
+        if((hdr = (cbuf_hdr *)(c->bufs[i] - CBUF_HDR))->fd >= 0)
+            shrink_buf(hdr, c->lens[i]);
 
+    if(c->n == 1 && buf_fd(c->bufs[0]) >= 0 && CBUF_HDR + c->size <= CBUF_SMALL)
+    {
+        // A memfd would waste most of a page and a descriptor
+        small = Cache_buf_alloc(0);
+        memcpy(small, c->bufs[0], c->size);
+        Cache_buf_free(c->bufs[0]);
+        c->bufs[0] = small;
+    }
+
+    acache = (cdata *)malloc(sizeof(cdata));
     acache->url = malloc(strlen(url)+1);
     strcpy(acache->url,url);
+    acache->hash = hash_url(url);
+    acache->shard = shard_of(acache->hash) - shards;
+
+    acache->cache = c->bufs[0];
+    acache->fd = buf_fd(c->bufs[0]);
+    acache->size = c->size;
+    acache->nchunks = c->n;
+    if(c->n == 1)
+    {
+        acache->chunks = (char **)&acache->cache;
+        acache->lens = &acache->size;
+        Free(c->bufs);
+        Free(c->lens);
+    }
+    else
+    {
+        acache->chunks = c->bufs;
+        acache->lens = c->lens;
+    }
+    c->bufs = NULL;
+    c->lens = NULL;
+    c->n = 0;
+
+    atomic_init(&acache->expires, fr ? fr->expires : LONG_MAX);
+    atomic_init(&acache->lifetime, fr ? fr->lifetime : 0);
+    atomic_init(&acache->strict, fr ? fr->strict : 0);
+    acache->etag = (fr && fr->etag[0]) ? strdup(fr->etag) : NULL;
+    acache->last_modified = (fr && fr->last_modified[0]) ? strdup(fr->last_modified) : NULL;
+    atomic_init(&acache->hits, 0);
+    atomic_init(&acache->refreshing, 0);
+
+    atomic_init(&acache->refcnt, 1);
+    atomic_init(&acache->referenced, 0);
+    atomic_init(&acache->hnext, NULL);
+    acache->next = NULL;
+    acache->prev = NULL;
+    acache->seg = 0;
+    return acache;
+}
 
-    Sem_init(&(acache->cmutex), 0, 1);
-    acache->cache = malloc(size);
-    memcpy(acache->cache, ptr, size);
-    acache->size = size;
-    acache->read_cnt = 0;
+// Memory node p takes besides its object: the node, its url and what its
+// buffer holds beyond the object
+static long node_overhead(cdata *p)
+{
+    long n = sizeof(cdata) + strlen(p->url) + 1 - p->size;
+    int i;
+
+    if(p->etag)
+        n += strlen(p->etag) + 1;
+    if(p->last_modified)
+        n += strlen(p->last_modified) + 1;
+
+    for(i = 0; i < p->nchunks; i++)
+        n += ((cbuf_hdr *)(p->chunks[i] - CBUF_HDR))->maplen;
+    if(p->nchunks > 1)
+        n += p->nchunks * (sizeof(char *) + sizeof(long));
+    return n;
+}
+
+cflight *Join_flight(char *url, int *leader_p)
+{
+    unsigned int hash = hash_url(url);
+    cshard *s = shard_of(hash);
+    cflight *f;
 
-    while((status = create_cache(acache)) == CACHE_FAILURE)
-        sleep(2);
-    if(status == CACHE_BY_OTHER)
+    P(&s->qmutex);
+    for(f = s->flights; f; f = f->next)
     {
-        if(acache->cache != NULL)
-            Free(acache->cache);
-        if(acache->url != NULL)
-            Free(acache->url);
-        if(acache != NULL)
-            Free(acache);
+        if(f->hash == hash && strcmp(f->url, url) == 0)
+        {
+            // Leader's reference keeps f alive while it is listed
+            atomic_fetch_add(&f->refcnt, 1);
+            V(&s->qmutex);
+            *leader_p = 0;
+            return f;
+        }
     }
 
-    return 0;
+    f = Malloc(sizeof(cflight));
+    f->url = Malloc(strlen(url) + 1);
+    strcpy(f->url, url);
+    f->hash = hash;
+    f->nfds = 0;
+    f->fds = NULL;
+    f->lens = NULL;
+    f->len = 0;
+    f->state = FLIGHT_RUNNING;
+    atomic_init(&f->refcnt, 1);
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->next = s->flights;
+    s->flights = f;
+    V(&s->qmutex);
+
+    *leader_p = 1;
+    return f;
 }
 
-// Check if already cached, if yes, then return
-// If cache is oversized, execute LRU policy to remove oldest node
-int create_cache(cdata* acache)
+void Flight_publish(cflight *f, cchain *c, int done)
 {
-    P(&qmutex);
-    cdata *p = head, *tmp;
-    while(p)
+    int i, fd;
+
+    if(f == NULL)
+        return;
+
+    pthread_mutex_lock(&f->mutex);
+    if((c == NULL || c->bufs == NULL) && f->state == FLIGHT_RUNNING)
+    {
+        f->state = FLIGHT_FAILED;
+        pthread_cond_broadcast(&f->cond);
+    }
+    else if(c && c->bufs && f->state == FLIGHT_RUNNING)
     {
-        if(strcmp(p->url, acache->url) == 0)    // already cached by other threads
+        // Own the memfds, so bytes outlive whatever cache does with chain.
+        // Followers can not read a heap buffer: publishing stops there and
+        // they fetch by themselves if they got nothing yet
+        for(i = f->nfds; i < c->n; i++)
         {
-            V(&qmutex);
-            return CACHE_BY_OTHER;
+            if(buf_fd(c->bufs[i]) < 0 ||
+               (fd = fcntl(buf_fd(c->bufs[i]), F_DUPFD_CLOEXEC, 0)) < 0)
+                break;
+            f->fds = Realloc(f->fds, (i + 1) * sizeof(int));
+            f->lens = Realloc(f->lens, (i + 1) * sizeof(long));
+            f->fds[i] = fd;
+            f->nfds++;
         }
-        p = p->next;
+        for(f->len = 0, i = 0; i < f->nfds; i++)
+            f->len += (f->lens[i] = c->lens[i]);
+        if(done && f->nfds == c->n)
+            f->state = FLIGHT_DONE;
+        pthread_cond_broadcast(&f->cond);
     }
+    pthread_mutex_unlock(&f->mutex);
+}
+
+int Flight_followers(cflight *f)
+{
+    return f ? atomic_load(&f->refcnt) - 1 : 0;
+}
+
+void End_flight(cflight *f)
+{
+    cshard *s = shard_of(f->hash);
+    cflight **pp;
+
+    // Later requesters start a flight of their own, or find url cached
+    P(&s->qmutex);
+    for(pp = &s->flights; *pp != f; pp = &(*pp)->next)
+        ;
+    *pp = f->next;
+    V(&s->qmutex);
+
+    pthread_mutex_lock(&f->mutex);
+    if(f->state == FLIGHT_RUNNING)
+        f->state = FLIGHT_FAILED;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
 
-    if((tsize += acache->size) > MAX_CACHE_SIZE)
+    leave_flight(f);
+}
+
+int Follow_flight(cflight *f, int fd)
+{
+    long avail, off = 0, base;
+    off_t pos;
+    int i, cfd, rc;
+    ssize_t n;
+
+    pthread_mutex_lock(&f->mutex);
+    while(1)
     {
-        p = head;
-        while(p && tsize > MAX_CACHE_SIZE)
+        while(f->state == FLIGHT_RUNNING && f->len == off)
+            pthread_cond_wait(&f->cond, &f->mutex);
+        if(f->state == FLIGHT_FAILED || f->len == off)
+            break;
+
+        // Send what is published of chunk holding off without holding the flight
+        for(base = 0, i = 0; off >= base + f->lens[i]; i++)
+            base += f->lens[i];
+        cfd = f->fds[i];
+        avail = base + f->lens[i];
+        pthread_mutex_unlock(&f->mutex);
+        while(off < avail)
         {
-            // Delete from head, delete it only if it is not occupied
-            P(&(acache->cmutex));
-            if(acache->read_cnt == 0)
-            {
-                tsize -= p->size;
-                delete_node(p);
-                tmp = p;
-                p = p->next;
-                if(tmp->url != NULL)
-                    Free(tmp->url);
-                if(tmp->cache != NULL)
-                    Free(tmp->cache);
-                if(tmp != NULL)
-                    Free(tmp);
-            }
-            else
-            {
-                V(&qmutex);
-                return CACHE_FAILURE;
-            }
-            V(&(acache->cmutex));
+            pos = CBUF_HDR + off - base;
+            n = sendfile(fd, cfd, &pos, avail - off);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            off += n;
         }
+        pthread_mutex_lock(&f->mutex);
+        if(off < avail)
+            break;
     }
+    rc = (f->state == FLIGHT_DONE && off == f->len) ? CACHED : off == 0 ? UNCACHED : -1;
+    pthread_mutex_unlock(&f->mutex);
 
-    // now there should be enough space to add, add to rear as latest
-    add_to_rear(acache);
-    V(&qmutex);
-    return CACHE_SUCCESS;
+    leave_flight(f);
+    return rc;
 }
 
-// Delete cache node p from cache
-void delete_node(cdata *p)
+// Drop a reference to flight, the last one frees it
+void leave_flight(cflight *f)
 {
-    if(p == NULL)
+    if(atomic_fetch_sub(&f->refcnt, 1) != 1)
         return;
 
-    if(p == head)
+    while(f->nfds > 0)
+        close(f->fds[--f->nfds]);
+    Free(f->fds);
+    Free(f->lens);
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->cond);
+    Free(f->url);
+    Free(f);
+}
+
+// cap == 0 asks for a heap buffer of CBUF_SMALL, also the fallback when no
+// memfd can be had
+char *Cache_buf_alloc(long cap)
+{
+    cbuf_hdr *hdr;
+    size_t len = CBUF_HDR + cap;
+    int fd;
+
+    if(cap > 0 && (fd = memfd_create("proxy-cache", MFD_CLOEXEC)) >= 0)
     {
-        head = p->next;
+        if(ftruncate(fd, len) == 0 &&
+           (hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED)
+        {
+            hdr->fd = fd;
+            hdr->maplen = len;
+            return (char *)hdr + CBUF_HDR;
+        }
+        close(fd);
     }
 
-    if(p == rear)
+    if(len < CBUF_SMALL)
+        len = CBUF_SMALL;
+    if((hdr = malloc(len)) == NULL)
+        return NULL;
+    hdr->fd = -1;
+    hdr->maplen = len;
+    return (char *)hdr + CBUF_HDR;
+}
+
+void Cache_buf_free(char *ptr)
+{
+    cbuf_hdr *hdr;
+
+    if(ptr == NULL)
+        return;
+
+    hdr = (cbuf_hdr *)(ptr - CBUF_HDR);
+    if(hdr->fd >= 0)
     {
-        rear = p->prev;
+        close(hdr->fd);
+        munmap(hdr, hdr->maplen);
     }
+    else
+        free(hdr);
+}
+
+// Memfd of cache buffer ptr, -1 if it is on the heap
+static int buf_fd(char *ptr)
+{
+    return ((cbuf_hdr *)(ptr - CBUF_HDR))->fd;
+}
 
+void Chain_init(cchain *c, long limit)
+{
+    c->n = 0;
+    c->cap = 4;
+    c->bufs = Malloc(c->cap * sizeof(char *));
+    c->lens = Malloc(c->cap * sizeof(long));
+    c->size = 0;
+    c->limit = limit;
+}
+
+// Add an empty buffer to c at index i
+static int chain_add(cchain *c, int i)
+{
+    char *buf;
 
-    if(p!=NULL && p->prev)
+    if((buf = Cache_buf_alloc(CACHE_CHUNK)) == NULL)
+        return -1;
+    if(c->n == c->cap)
     {
-        p->prev->next = p->next;
+        c->cap *= 2;
+        c->bufs = Realloc(c->bufs, c->cap * sizeof(char *));
+        c->lens = Realloc(c->lens, c->cap * sizeof(long));
     }
+    memmove(c->bufs + i + 1, c->bufs + i, (c->n - i) * sizeof(char *));
+    memmove(c->lens + i + 1, c->lens + i, (c->n - i) * sizeof(long));
+    c->bufs[i] = buf;
+    c->lens[i] = 0;
+    c->n++;
+    return 0;
+}
+
+int Chain_append(cchain *c, char *buf, long len)
+{
+    long k;
 
-    if(p!=NULL && p->next)
+    if(c->bufs == NULL)
+        return -1;
+    if(c->size + len > c->limit)
     {
-        p->next->prev = p->prev;
+        Chain_free(c);
+        return -1;
+    }
+
+    while(len > 0)
+    {
+        if((c->n == 0 || c->lens[c->n - 1] == CACHE_CHUNK) && chain_add(c, c->n) == -1)
+        {
+            Chain_free(c);
+            return -1;
+        }
+        k = CACHE_CHUNK - c->lens[c->n - 1];
+        if(k > len)
+            k = len;
+        memcpy(c->bufs[c->n - 1] + c->lens[c->n - 1], buf, k);
+        c->lens[c->n - 1] += k;
+        c->size += k;
+        buf += k;
+        len -= k;
+    }
+    return 0;
+}
+
+// Append pieces of iov, the limit is checked once for all of them
+int Chain_appendv(cchain *c, struct iovec *iov, int n)
+{
+    long len = 0;
+    int i;
+
+    for(i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    if(c->bufs == NULL)
+        return -1;
+    if(c->size + len > c->limit)
+    {
+        Chain_free(c);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++)
+        if(Chain_append(c, iov[i].iov_base, iov[i].iov_len) == -1)
+            return -1;
+    return 0;
+}
+
+// Insert len bytes at offset pos. Where the buffer holding pos is too full,
+// its bytes after pos move to a new buffer behind it
+int Chain_insert(cchain *c, long pos, char *buf, long len)
+{
+    long base = 0, at, k;
+    int i = 0;
+
+    if(c->bufs == NULL)
+        return -1;
+    if(c->size + len > c->limit || pos > c->size || len > CACHE_CHUNK)
+    {
+        Chain_free(c);
+        return -1;
+    }
+    if(pos == c->size)
+        return Chain_append(c, buf, len);
+
+    while(pos >= base + c->lens[i])
+        base += c->lens[i++];
+    at = pos - base;
+
+    // No room in buffer i: split it at pos into a new buffer after it. The
+    // bytes inserted fill up buffer i, what does not fit goes in front of
+    // the new one, which is then at most as full as buffer i was
+    if(c->lens[i] + len > CACHE_CHUNK)
+    {
+        if(chain_add(c, i + 1) == -1)
+        {
+            Chain_free(c);
+            return -1;
+        }
+        memcpy(c->bufs[i + 1], c->bufs[i] + at, c->lens[i] - at);
+        c->lens[i + 1] = c->lens[i] - at;
+        c->lens[i] = at;
+
+        k = (len < CACHE_CHUNK - at) ? len : CACHE_CHUNK - at;
+        memcpy(c->bufs[i] + at, buf, k);
+        c->lens[i] += k;
+        memmove(c->bufs[i + 1] + len - k, c->bufs[i + 1], c->lens[i + 1]);
+        memcpy(c->bufs[i + 1], buf + k, len - k);
+        c->lens[i + 1] += len - k;
+        c->size += len;
+        return 0;
     }
 
+    memmove(c->bufs[i] + at + len, c->bufs[i] + at, c->lens[i] - at);
+    memcpy(c->bufs[i] + at, buf, len);
+    c->lens[i] += len;
+    c->size += len;
+    return 0;
+}
+
+void Chain_free(cchain *c)
+{
+    int i;
 
+    if(c->bufs == NULL)
+        return;
+    for(i = 0; i < c->n; i++)
+        Cache_buf_free(c->bufs[i]);
+    Free(c->bufs);
+    Free(c->lens);
+    c->bufs = NULL;
+    c->lens = NULL;
+    c->n = 0;
 }
 
-// Insert cache node p to the rear of cache
-void add_to_rear(cdata *p)
+// Give back memfd pages and mapping beyond the size data ended up with
+void shrink_buf(cbuf_hdr *hdr, long size)
 {
-    if(p == NULL)
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = CBUF_HDR + size;
+    size_t keep = (len + page - 1) / page * page;
+
+    if(ftruncate(hdr->fd, len) < 0)
         return;
-    if(head==NULL || rear==NULL)        // If linked list is empty
+    if(keep < hdr->maplen)
     {
-        head = p;
-        rear = p;
-        if(head->prev != NULL)
-            head->prev = NULL;
-        if(head->next != NULL)
-            head->next = NULL;
+        munmap((char *)hdr + keep, hdr->maplen - keep);
+        hdr->maplen = keep;
     }
-    else
+}
+
+// FNV-1a hash of url
+unsigned int hash_url(char *url)
+{
+    unsigned int h = 2166136261u;
+
+    while(*url)
     {
-        if(rear != NULL)
-            p->prev = rear;
-        if(p != NULL)
-            rear->next = p;
-        if(p->next != NULL)
-            p->next = NULL;
-        rear = p;
+        h ^= (unsigned char)*url++;
+        h *= 16777619u;
     }
+    return h;
 }
 
-// Find cache node cooresponding to given url, increase reader count,
-// move this node to the end of linked list
-cdata *get_from_cache(char *url)
+cshard *shard_of(unsigned int hash)
+{
+    return &shards[hash % nshards];
+}
+
+// Shard a new node of hash goes to
+static cshard *place_of(unsigned int hash)
+{
+    return (local && my_shard >= 0) ? &shards[my_shard] : shard_of(hash);
+}
+
+static cdata *_Atomic *bucket_of(cshard *s, unsigned int hash)
+{
+    return &s->bucket[(hash / nshards) & (CACHE_BUCKETS - 1)];
+}
+
+// Check if already cached, if yes, then return, or unless replace drop
+// the copy there is. With local placement a copy may be in any shard: it
+// is served from there rather than stored twice, or dropped once the new
+// node is admitted.
+// If shard is oversized, let policy pick nodes to remove. With TinyLFU a
+// new node must be more frequent than every victim it displaces, so big
+// objects have to beat more of them. Victims are only taken off the policy
+// lists until that is decided: a rejected node evicts nothing, not even
+// the copy it would replace
+int create_cache(cdata* acache, int replace)
 {
-    P(&qmutex);
-    cdata *p = head;
-    while(p)
+    cshard *s = place_of(acache->hash), *o;
+    cdata *_Atomic *bp = bucket_of(s, acache->hash);
+    cdata *p, *old = NULL, **victims = NULL;
+    int freq, i, n = 0, cap = 0, rejected = 0;
+    long size;
+
+    acache->shard = s - shards;
+    for(i = 0; local && !replace && i < nshards; i++)
+        if(&shards[i] != s && find_node(&shards[i], acache->hash, acache->url, 0))
+            return CACHE_BY_OTHER;
+
+    P(&s->qmutex);
+    reclaim(s);
+
+    for(p = atomic_load(bp); p; p = atomic_load(&p->hnext))
     {
-        if(strcmp(p->url, url) == 0)
+        if(p->hash == acache->hash && strcmp(p->url, acache->url) == 0)    // already cached by other threads
         {
-            P(&(p->cmutex));
-            (p->read_cnt)++;
-            V(&(p->cmutex));
-
-            // move p to rear
-            if(rear != p)
+            if(replace)
             {
-                delete_node(p);
-                add_to_rear(p);
+                old = p;    // goes once the new node is admitted
+                break;
             }
+            V(&s->qmutex);
+            return CACHE_BY_OTHER;
+        }
+    }
+
+    // Old copy is not up against the new one, its room is counted as free
+    freq = tinylfu ? sketch_freq(s, acache->hash) : 0;
+    size = s->tsize + acache->size - (old ? old->size : 0);
+    while(size > shard_size && (p = policy->victim(s)) != NULL)
+    {
+        policy->remove(s, p);
+        if(n == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            victims = Realloc(victims, cap * sizeof(cdata *));
+        }
+        victims[n++] = p;
+        if(p == old)
+            continue;
+        size -= p->size;
+        if(tinylfu && freq <= sketch_freq(s, p->hash))
+        {
+            rejected = 1;
             break;
         }
-        p = p->next;
     }
 
-    V(&qmutex);
+    // Victims go back on the lists and are then evicted the usual way, or
+    // stay if the new node lost against one of them
+    for(i = n - 1; i >= 0; i--)
+        policy->restore(s, victims[i]);
+    if(rejected)
+    {
+        s->rejected++;
+        V(&s->qmutex);
+        Free(victims);
+        return CACHE_REJECTED;
+    }
+    for(i = 0; i < n; i++)
+        if(victims[i] != old)
+            evict_node(s, victims[i]);
+    if(old)
+        evict_node(s, old);
+    Free(victims);
+
+    // now there should be enough space to add, publish node to readers
+    s->tsize += acache->size;
+    s->index_bytes += node_overhead(acache);
+    s->admitted++;
+    policy->add(s, acache);
+    atomic_store_explicit(&acache->hnext, atomic_load(bp), memory_order_relaxed);
+    atomic_store_explicit(bp, acache, memory_order_release);
+    V(&s->qmutex);
+
+    // Copies in other shards are only dropped now, one shard locked at a time
+    for(i = 0; local && replace && i < nshards; i++)
+    {
+        o = &shards[i];
+        if(o == s || find_node(o, acache->hash, acache->url, 0) == NULL)
+            continue;
+
+        // Look again under lock, it may have gone meanwhile
+        P(&o->qmutex);
+        for(p = atomic_load(bucket_of(o, acache->hash)); p; p = atomic_load(&p->hnext))
+            if(p->hash == acache->hash && strcmp(p->url, acache->url) == 0)
+                break;
+        if(p)
+            evict_node(o, p);
+        V(&o->qmutex);
+    }
+    return CACHE_SUCCESS;
+}
+
+// Remove node p picked by policy. A node still in use by readers is
+// unlinked all the same, the last reader frees it in Release_cache
+void evict_node(cshard *s, cdata *p)
+{
+    s->tsize -= p->size;
+    s->index_bytes -= node_overhead(p);
+    s->evicted++;
+    delete_node(s, p);
+
+    // Drop the cache's own reference
+    if(atomic_fetch_sub(&p->refcnt, 1) == 1)
+        retire_node(s, p);
+}
+
+// Unlink cache node p from hash index and policy lists of shard. Readers
+// already at p can still follow p->hnext
+void delete_node(cshard *s, cdata *p)
+{
+    cdata *_Atomic *pp = bucket_of(s, p->hash);
+
+    while(atomic_load(pp) != p)
+        pp = &atomic_load(pp)->hnext;
+    atomic_store_explicit(pp, atomic_load(&p->hnext), memory_order_release);
+
+    policy->remove(s, p);
+}
+
+// Insert p into l before node at, at the rear if at is NULL
+static void list_insert(clist *l, cdata *at, cdata *p)
+{
+    p->next = at;
+    p->prev = at ? at->prev : l->rear;
+    if(p->prev)
+        p->prev->next = p;
+    else
+        l->head = p;
+    if(at)
+        at->prev = p;
+    else
+        l->rear = p;
+    l->count++;
+    l->bytes += p->size;
+}
+
+static void list_unlink(clist *l, cdata *p)
+{
+    if(p->prev)
+        p->prev->next = p->next;
+    else
+        l->head = p->next;
+    if(p->next)
+        p->next->prev = p->prev;
+    else
+        l->rear = p->prev;
+    p->next = NULL;
+    p->prev = NULL;
+    l->count--;
+    l->bytes -= p->size;
+}
+
+// CLOCK: one ring, a new node goes just behind the hand so that it
+// survives a full sweep
+static void clock_add(cshard *s, cdata *p)
+{
+    list_insert(&s->seg[0], s->hand, p);
+}
+
+static void clock_remove(cshard *s, cdata *p)
+{
+    if(p == s->hand)
+        s->hand = p->next;
+    list_unlink(&s->seg[0], p);
+}
+
+// Advance CLOCK hand to a node that was not referenced since last sweep
+static cdata *clock_victim(cshard *s)
+{
+    cdata *p;
+
+    if(s->seg[0].head == NULL)
+        return NULL;
+
+    while(1)
+    {
+        p = s->hand ? s->hand : s->seg[0].head;
+        s->hand = p->next;
+
+        if(!atomic_exchange_explicit(&p->referenced, 0, memory_order_relaxed))
+            return p;
+        // second chance
+    }
+}
+
+// Put victim p back where the hand took it, hand on it
+static void clock_restore(cshard *s, cdata *p)
+{
+    list_insert(&s->seg[0], s->hand, p);
+    s->hand = p;
+}
+
+// Segmented LRU: new nodes are on probation, a node referenced there is
+// promoted to the protected segment once eviction gets to it. Protected
+// segment holds up to SLRU_PROTECTED percent of shard, its least recently
+// promoted nodes go back on probation
+static void slru_add(cshard *s, cdata *p)
+{
+    p->seg = 0;
+    list_insert(&s->seg[0], NULL, p);
+}
+
+static void slru_remove(cshard *s, cdata *p)
+{
+    list_unlink(&s->seg[p->seg], p);
+}
+
+static cdata *slru_victim(cshard *s)
+{
+    clist *prob = &s->seg[0], *prot = &s->seg[1];
+    cdata *p;
+
+    while(1)
+    {
+        // Keep protected segment in its bounds, it gets a CLOCK second chance
+        while(prot->head && (prot->bytes > shard_size / 100 * SLRU_PROTECTED ||
+                             prob->head == NULL))
+        {
+            p = prot->head;
+            list_unlink(prot, p);
+            p->seg = atomic_exchange_explicit(&p->referenced, 0, memory_order_relaxed) ? 1 : 0;
+            list_insert(&s->seg[p->seg], NULL, p);
+            if(p->seg == 0)
+                break;
+        }
+
+        if((p = prob->head) == NULL)
+            return NULL;
+        if(!atomic_exchange_explicit(&p->referenced, 0, memory_order_relaxed))
+            return p;
+
+        // Hit while on probation: promote
+        list_unlink(prob, p);
+        p->seg = 1;
+        list_insert(prot, NULL, p);
+    }
+}
+
+// Put victim p back at the head of probation
+static void slru_restore(cshard *s, cdata *p)
+{
+    p->seg = 0;
+    list_insert(&s->seg[0], s->seg[0].head, p);
+}
+
+// Count an access to hash in sketch of its shard. Once SKETCH_SAMPLE accesses
+// are counted every count is halved, so old popularity fades
+static void sketch_add(cshard *s, unsigned int hash)
+{
+    int i, j, c;
+
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        j = ((hash ^ (hash >> 15)) * (2654435761u + 2 * i)) >> 22 & (SKETCH_WIDTH - 1);
+        if((c = atomic_load_explicit(&s->sketch[i][j], memory_order_relaxed)) < 15)
+            atomic_store_explicit(&s->sketch[i][j], c + 1, memory_order_relaxed);
+    }
+
+    if(atomic_fetch_add(&s->sketch_adds, 1) + 1 == SKETCH_SAMPLE)
+    {
+        for(i = 0; i < SKETCH_DEPTH; i++)
+            for(j = 0; j < SKETCH_WIDTH; j++)
+                atomic_store_explicit(&s->sketch[i][j],
+                    atomic_load_explicit(&s->sketch[i][j], memory_order_relaxed) / 2,
+                    memory_order_relaxed);
+        atomic_fetch_sub(&s->sketch_adds, SKETCH_SAMPLE);
+    }
+}
+
+// Estimated number of recent accesses to hash: least count of its cells
+static int sketch_freq(cshard *s, unsigned int hash)
+{
+    int i, j, c, min = 15;
+
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        j = ((hash ^ (hash >> 15)) * (2654435761u + 2 * i)) >> 22 & (SKETCH_WIDTH - 1);
+        if((c = atomic_load_explicit(&s->sketch[i][j], memory_order_relaxed)) < min)
+            min = c;
+    }
+    return min;
+}
+
+// Find node of url in cache and pin it, without locks. With local placement
+// the shard of calling thread is looked at first, then the others in turn.
+// Recency is only recorded in the referenced bit
+cdata *get_from_cache(char *url)
+{
+    unsigned int hash = hash_url(url);
+    cshard *s = place_of(hash);
+    cdata *p;
+    int i;
+
+    p = find_node(s, hash, url, 1);
+    for(i = 1; p == NULL && local && i < nshards; i++)
+        p = find_node(&shards[(s - shards + i) % nshards], hash, url, 1);
+
+    if(tinylfu)
+        sketch_add(s, hash);
+    if(p)
+    {
+        atomic_fetch_add_explicit(&s->readers[my_stripe].hits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->readers[my_stripe].hit_bytes, p->size, memory_order_relaxed);
+    }
+    else
+        atomic_fetch_add_explicit(&s->readers[my_stripe].misses, 1, memory_order_relaxed);
+    return p;
+}
+
+// Node of url in shard s, pinned if pin is set (NULL if eviction already
+// dropped the cache's reference), else only looked at
+static cdata *find_node(cshard *s, unsigned int hash, char *url, int pin)
+{
+    unsigned long e;
+    cdata *p;
+    int cnt;
+
+    e = epoch_enter(s);
+    for(p = atomic_load_explicit(bucket_of(s, hash), memory_order_acquire); p;
+        p = atomic_load_explicit(&p->hnext, memory_order_acquire))
+    {
+        if(p->hash != hash || strcmp(p->url, url) != 0)
+            continue;
+        if(!pin)
+            break;
+
+        // Pin p unless eviction already dropped the cache's reference
+        cnt = atomic_load(&p->refcnt);
+        while(cnt > 0 && !atomic_compare_exchange_weak(&p->refcnt, &cnt, cnt + 1))
+            ;
+        if(cnt == 0)
+            p = NULL;
+        else
+        {
+            atomic_fetch_add_explicit(&p->hits, 1, memory_order_relaxed);
+            if(!atomic_load_explicit(&p->referenced, memory_order_relaxed))
+                atomic_store_explicit(&p->referenced, 1, memory_order_relaxed);
+        }
+        break;
+    }
+    epoch_exit(s, e);
     return p;
 }
 
+// Stripe of calling thread, threads are spread over stripes in turn
+static int stripe()
+{
+    if(my_stripe < 0)
+        my_stripe = atomic_fetch_add(&stripe_cnt, 1) % EPOCH_STRIPES;
+    return my_stripe;
+}
+
+// Register as reader of shard in the current epoch, return that epoch
+unsigned long epoch_enter(cshard *s)
+{
+    int me = stripe();
+    unsigned long e;
 
+    while(1)
+    {
+        e = atomic_load(&s->epoch);
+        atomic_fetch_add(&s->readers[me].n[e & 1], 1);
+        if(atomic_load(&s->epoch) == e)
+            return e;
+        // Epoch moved on before we were counted, try again
+        atomic_fetch_sub(&s->readers[me].n[e & 1], 1);
+    }
+}
+
+void epoch_exit(cshard *s, unsigned long e)
+{
+    atomic_fetch_sub(&s->readers[my_stripe].n[e & 1], 1);
+}
+
+// Queue an unlinked node whose references are all gone. Shard mutex held
+void retire_node(cshard *s, cdata *p)
+{
+    p->retire_epoch = atomic_load(&s->epoch);
+    p->next = s->retired;
+    s->retired = p;
+    reclaim(s);
+}
+
+// Advance shard epoch once no reader of the previous epoch is left, and free
+// nodes retired two epochs ago: every reader that could see them has left.
+// Never waits for readers. Shard mutex held
+void reclaim(cshard *s)
+{
+    unsigned long e = atomic_load(&s->epoch);
+    cdata **pp, *p;
+    int i;
+
+    for(i = 0; i < EPOCH_STRIPES; i++)
+        if(atomic_load(&s->readers[i].n[(e + 1) & 1]) != 0)
+            break;
+    if(i == EPOCH_STRIPES)
+        atomic_store(&s->epoch, ++e);
+
+    pp = &s->retired;
+    while((p = *pp) != NULL)
+    {
+        if(p->retire_epoch + 2 <= e)
+        {
+            *pp = p->next;
+            free_node(p);
+        }
+        else
+            pp = &p->next;
+    }
+}
+
+void free_node(cdata *p)
+{
+    int i;
+
+    if(p->url != NULL)
+        Free(p->url);
+    free(p->etag);
+    free(p->last_modified);
+    for(i = 0; i < p->nchunks; i++)
+        Cache_buf_free(p->chunks[i]);
+    if(p->nchunks > 1)
+    {
+        Free(p->chunks);
+        Free(p->lens);
+    }
+    Free(p);
+}
@@ -1,33 +1,229 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdatomic.h>
+#include <sys/uio.h>
 #include "csapp.h"
 
 #define CACHED 1
 #define UNCACHED 2
 #define CACHE_SUCCESS 3
-#define CACHE_FAILURE 4
+#define CACHE_FRESH 0           // see Cache_check
+#define CACHE_DUE 1
+#define CACHE_STALE 2
 #define CACHE_BY_OTHER 5
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#define CACHE_REJECTED 6        // admission policy kept the victims instead
+#define FLIGHT_RUNNING 0
+#define FLIGHT_DONE 1
+#define FLIGHT_FAILED 2
+#define MAX_CACHE_SIZE 1049000  // default capacity, see cache_conf_t
+#define MAX_OBJECT_SIZE 102400  // default largest object
+#define FLIGHT_MAX_RELAY (16 << 20)     // largest uncached response relayed to followers
+#define CACHE_SHARDS 8          // default number of independently locked parts
+#define CACHE_BUCKETS 1024      // hash buckets per shard, power of 2
+#define EPOCH_STRIPES 16        // reader counters per shard, spread over threads
+#define CBUF_HDR 64             // offset of data in a cache buffer
+#define CBUF_SMALL 4096         // smaller objects are kept on the heap
+#define CACHE_CHUNK (1 << 20)   // capacity of each buffer of a chain
+#define SLRU_PROTECTED 80       // percent of shard for SLRU protected segment
+#define SKETCH_DEPTH 4          // TinyLFU sketch rows per shard
+#define SKETCH_WIDTH 1024       // counters per row, power of 2
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)   // accesses between halvings
+#define CACHE_VALIDATOR_MAX 128 // longer ETag or Last-Modified is not kept
+#define CACHE_GRACE 10          // default seconds hot objects are served stale
+#define CACHE_HOT_HITS 2        // hits that make an object hot
+#define CACHE_REFRESH_AHEAD 10  // percent of its lifetime before expiry a hot
+                                // object is refreshed
+#define CACHE_REFRESH_AHEAD_MAX 60  // seconds at most
 
+// Readers find and pin nodes without any lock: hash chains are walked with
+// atomic loads inside a shard epoch, so unlinked nodes are only freed once
+// no reader can still see them. Writers hold the shard mutex
 struct data_node
 {
     char *url;
-    int size;
-    void *cache;
-    int read_cnt;
-    sem_t cmutex;   // mutex for cache reader
-    struct data_node *next;
+    unsigned int hash;  // hash of url, picks shard and bucket
+    long size;
+    void *cache;        // first chunk
+    int fd;             // memfd holding cache at offset CBUF_HDR, -1 if on heap
+    int nchunks;        // large objects are a chain of cache buffers
+    char **chunks;      // chunks[0] is cache, &cache if just one
+    long *lens;         // bytes of each chunk, &size if just one
+    atomic_long expires;        // served without asking server until then
+    atomic_long lifetime;       // seconds it was fresh for when stored or revalidated
+    atomic_int strict;          // never served stale, not even in grace
+    char *etag;                 // validators to revalidate with, NULL if none
+    char *last_modified;
+    atomic_long hits;           // lookups that found this node
+    atomic_int refreshing;      // claimed for background refresh
+    atomic_int refcnt;          // 1 for the cache itself + 1 per reader
+    atomic_int referenced;      // set by readers on hit, cleared by policy
+    struct data_node *_Atomic hnext;    // next node in same hash bucket
+    struct data_node *next;     // policy list of shard
     struct data_node *prev;
+    int shard;                  // which shard node is in
+    int seg;                    // which list of shard node is on
+    unsigned long retire_epoch; // shard epoch when node was unlinked
 };
 
 typedef struct data_node cdata;
 
-void Cache_init();
+// A cache miss being fetched. The first requester of the url (the leader)
+// stores the response in a memfd cache buffer, later requesters follow the
+// bytes it publishes there instead of asking the server again
+struct flight
+{
+    char *url;
+    unsigned int hash;
+    int nfds;           // chunks published so far
+    int *fds;           // dup of memfd of each chunk of leader's chain
+    long *lens;         // bytes of each chunk that are final
+    long len;           // bytes of all chunks that are final
+    int state;          // FLIGHT_*
+    atomic_int refcnt;  // leader + followers
+    pthread_mutex_t mutex;      // protects chunks, len, state
+    pthread_cond_t cond;        // signaled when len or state change
+    struct flight *next;        // next flight in same shard
+};
+
+typedef struct flight cflight;
+
+// Response being stored, as a chain of cache buffers filled in turn. Buffers
+// are allocated as bytes arrive, so no object ever needs one contiguous copy
+typedef struct
+{
+    int n, cap;         // buffers in use, room in arrays
+    char **bufs;        // from Cache_buf_alloc(CACHE_CHUNK), NULL once dropped
+    long *lens;         // bytes of each buffer
+    long size;          // bytes of all buffers
+    long limit;         // chain is dropped if it would grow beyond
+} cchain;
+
+// How long a stored response is fresh and how to revalidate it after
+typedef struct
+{
+    time_t expires;
+    long lifetime;                      // seconds fresh from when it was stored
+    int strict;                         // never served once stale, see http_freshness
+    char etag[CACHE_VALIDATOR_MAX];     // empty if server gave none
+    char last_modified[CACHE_VALIDATOR_MAX];
+} cfresh;
+
+// Cache configuration, given to Cache_init
+typedef struct
+{
+    char *policy;       // eviction policy, "clock" or "slru"
+    int tinylfu;        // admit a new object only if asked for more often than victims
+    long capacity;      // bytes of objects in all shards together
+    long max_object;    // largest object cached, each shard must hold one
+    int shards;
+    long grace;         // seconds a hot object is still served after it
+                        // expires while refreshed in background, 0: never
+    int local;          // store nodes in the shard of the inserting thread
+                        // (see Cache_local) instead of by url hash
+} cache_conf_t;
+
+// Cache statistics, summed over shards
+typedef struct
+{
+    char *policy;
+    int tinylfu;
+    long capacity, shard_capacity;
+    long objects, bytes;
+    long index_bytes;           // memory of nodes besides object bytes: node,
+                                // url and buffer slack
+    long table_bytes;           // memory of shards, whatever they hold
+    long hits, hit_bytes;       // lookups served from cache
+    long misses, miss_bytes;    // lookups not served, bytes then inserted
+    long disk_hits, disk_hit_bytes;     // lookups served from disk tier
+    long revalidated, revalidated_bytes;    // stale hits server said were
+                                            // still good, bytes not fetched
+    long admitted, rejected, evicted;
+} cache_stats_t;
+
+// Returns -1 if conf asks for an unknown policy or limits that do not fit
+int Cache_init(cache_conf_t *conf);
+void Cache_stats(cache_stats_t *st);
+
+// Calling thread stores into shard (mod shard count) and looks there first.
+// Only with local placement, a thread that never calls this goes by url hash
+void Cache_local(int shard);
+
+// Largest object the cache takes, responses are buffered up to this size
+long Cache_max_object();
+
+// Check if given request url is in cache and fresh, if yes, then forward cache to browser with CACHED returned
+// otherwise, return UNCACHED. A stale copy that has validators is left
+// pinned in *stale_p (if not NULL) to be revalidated, so is a copy sent that
+// is due for refresh (CACHE_DUE). Else *stale_p is NULL
+int Get_cache(char *url, int browserfd, cdata **stale_p);
+
+// Insert url with the response in chain c to cache, replacing any copy
+// there is. Buffers of c are adopted, not copied: c is left empty whatever
+// the result. fr NULL: response never goes stale. Returns -1 if it was not
+// stored, in memory or on disk
+int Insert_cache(char *url, cchain *c, cfresh *fr);
+
+// Whether pinned node may be served without asking server
+int Cache_fresh(cdata *acache);
+
+// What to do with pinned node: CACHE_FRESH serve it, CACHE_STALE revalidate
+// it first, CACHE_DUE serve it and have it refreshed in background. A hot
+// node is due once CACHE_REFRESH_AHEAD percent of its lifetime is left, and
+// unless strict until grace has passed after it expired; only one caller is
+// told so until refreshing is cleared again
+int Cache_check(cdata *acache);
+
+// Server confirmed pinned stale node is still good, fresh for life seconds
+// from now on, strict like cfresh
+void Cache_refresh(cdata *acache, long life, int strict);
+
+// Write whole object of pinned node to fd, or bytes [off, end) of it.
+// -1 if fd failed
+int Write_cache(cdata *acache, int fd);
+int Write_cache_range(cdata *acache, int fd, long off, long end);
+
+// Buffers for building a response that may become a cache node. Data lives
+// in a memfd mapping so that hits can be sent with sendfile
+char *Cache_buf_alloc(long cap);
+void Cache_buf_free(char *ptr);
+
+// Chains of cache buffers. Chain_append(v) and Chain_insert drop the whole
+// chain and return -1 once it would grow beyond its limit
+void Chain_init(cchain *c, long limit);
+int Chain_append(cchain *c, char *buf, long len);
+int Chain_appendv(cchain *c, struct iovec *iov, int n);
+int Chain_insert(cchain *c, long pos, char *buf, long len);
+void Chain_free(cchain *c);
+
+// Find the cache node of given url and pin it as a reader, NULL if not cached.
+// A pinned node must be handed back with Release_cache once written out
+cdata *Lookup_cache(char *url);
+void Release_cache(cdata *acache);
+
+// Send bytes of pinned node from *off_p up to end to fd, with sendfile if
+// node lives in a memfd. Returns like write(2) and advances *off_p
+ssize_t Send_cache(cdata *acache, int fd, long *off_p, long end);
+
+// Follow the fetch of url in flight, or start one with *leader_p set: the
+// caller then fetches url and ends the flight with End_flight
+cflight *Join_flight(char *url, int *leader_p);
+
+// Leader: bytes in chain c are final, done if that is the whole response as
+// stored in cache. c NULL: response will not be stored, followers need not
+// wait for it
+void Flight_publish(cflight *f, cchain *c, int done);
 
-// Check if given request url is in cache, if yes, then forward cache to browser with CACHED returned
-// otherwise, return UNCACHED
-int Get_cache(char *url, int browserfd);
+// Leader: requests following f so far
+int Flight_followers(cflight *f);
 
-// Insert a <url,ptr> pair to cache
-int Insert_cache(char *url, char *ptr, int size);
+// Leader: fetch is over, followers still waiting fetch by themselves unless
+// it was published as done
+void End_flight(cflight *f);
 
+// Follower: send bytes to fd as leader publishes them. Returns CACHED once
+// the whole response went out, UNCACHED if leader gave up before anything
+// was sent, -1 if leader or fd failed in the middle
+int Follow_flight(cflight *f, int fd);
 
+#endif /* __CACHE_H__ */
@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include "dns.h"
 
 /**************************
  * Error-handling functions
@@ -615,7 +616,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
-    if (rp->rio_cnt < n)
+    if ((size_t)rp->rio_cnt < n)
         cnt = rp->rio_cnt;
     memcpy(usrbuf, rp->rio_bufptr, cnt);
     rp->rio_bufptr += cnt;
@@ -663,32 +664,110 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_fillb - Read more bytes into the internal buffer behind the unread
+ *    ones, which are first moved to the front of it. Lets a caller parse
+ *    in place what has arrived so far. Returns bytes read, 0 on EOF or
+ *    when the buffer is full, -1 on error.
+ */
+/* $begin rio_fillb */
+ssize_t rio_fillb(rio_t *rp)
+{
+    ssize_t n;
+    char *end;
+
+    if (rp->rio_cnt <= 0)
+        rp->rio_cnt = 0;
+    else if (rp->rio_bufptr != rp->rio_buf)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+
+    end = rp->rio_buf + rp->rio_cnt;
+    if (end == rp->rio_buf + RIO_BUFSIZE)
+        return 0;
+
+    while ((n = read(rp->rio_fd, end, rp->rio_buf + RIO_BUFSIZE - end)) < 0)
+        if (errno != EINTR) /* interrupted by sig handler return */
+            return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+/* $end rio_fillb */
+
+/*
+ * rio_readlineb - robustly read a text line (buffered). The internal
+ *    buffer is scanned for the newline with memchr and copied in bulk.
+ *    Returns the number of bytes stored, not counting the NUL.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *nl = NULL, *bufp = usrbuf;
+
+    while (n + 1 < maxlen && nl == NULL) {
+        if (rp->rio_cnt <= 0) {
+            if ((rc = rio_fillb(rp)) < 0)
+                return -1;  /* error */
+            else if (rc == 0)
+                break;      /* EOF */
+        }
+
+        cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt)
+            cnt = rp->rio_cnt;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = nl + 1 - rp->rio_bufptr;
+
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        n += cnt;
     }
-    *bufp = 0;
+    if (maxlen > 0)
+        bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_getlineb - find the next text line in the internal buffer and hand
+ *    it out through *linep without copying, newline included. The line is
+ *    not NUL terminated and stays valid until the next read from rp. A
+ *    line longer than RIO_BUFSIZE comes out in pieces. Returns its length,
+ *    0 on EOF, -1 on error.
+ */
+/* $begin rio_getlineb */
+ssize_t rio_getlineb(rio_t *rp, char **linep)
+{
+    size_t scanned = 0;
+    ssize_t n;
+    char *nl;
+
+    if (rp->rio_cnt < 0)
+        rp->rio_cnt = 0;
+
+    /* Only bytes that arrived since the last scan are looked at again */
+    while ((nl = memchr(rp->rio_bufptr + scanned, '\n', rp->rio_cnt - scanned)) == NULL) {
+        scanned = rp->rio_cnt;
+        if ((n = rio_fillb(rp)) < 0)
+            return -1;
+        if (n == 0) {
+            if (rp->rio_cnt == 0)
+                return 0;   /* EOF, no data read */
+            nl = rp->rio_bufptr + rp->rio_cnt - 1;
+            break;          /* EOF or full buffer, line so far */
+        }
+    }
+
+    n = nl + 1 - rp->rio_bufptr;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_getlineb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -708,7 +787,7 @@ ssize_t Rio_writen(int fd, void *usrbuf, size_t n)
 {
     ssize_t rc;
 
-    if ((rc = rio_writen(fd, usrbuf, n)) != n){
+    if ((rc = rio_writen(fd, usrbuf, n)) != (ssize_t)n){
         if(errno != ECONNRESET && errno != EPIPE){
             unix_error("Rio_writen error");
         }
@@ -751,32 +830,29 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /*
  * open_clientfd - open connection to server at <hostname, port>
  *   and return a socket descriptor ready for reading and writing.
+ *   Host names are resolved through the cache of dns.c.
  *   Returns -1 and sets errno on Unix error.
- *   Returns -2 and sets h_errno on DNS (gethostbyname) error.
+ *   Returns -2 on DNS error.
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, int port)
 {
     int clientfd;
     struct sockaddr_in serveraddr;
-    struct addrinfo *addr_info;
-
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        return -1;
-
-    // use Getaddrinfo for thread safety
-    if(Getaddrinfo(hostname, &addr_info) == -1){
-        return -2;
-    }
 
     bzero((char *) &serveraddr, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_port = htons(port);
-    serveraddr.sin_addr.s_addr = ((struct sockaddr_in*)(addr_info->ai_addr))->sin_addr.s_addr;
-    freeaddrinfo(addr_info);
+    if (Dns_resolve(hostname, &serveraddr.sin_addr) == -1)
+        return -2;
 
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0) {
+        close(clientfd);
         return -1;
+    }
     return clientfd;
 }
 /* $end open_clientfd */
@@ -0,0 +1,496 @@
+/*
+ * Disk tier of the cache.
+ *
+ * Objects taken into the cache are also appended to log structured segment
+ * files by a writer thread, so the cache outlives a restart and can hold
+ * far more than memory. Each record is a header, the url, the validators
+ * and the object. Freshness is kept as it was when written: a copy
+ * revalidated since is revalidated again after a restart.
+ * An index in memory maps urls to their latest record; it is rebuilt on
+ * startup from the record headers alone, without reading any object. Once
+ * there are DISK_MAX_SEGS segments the oldest one is dropped whole, along
+ * with its index entries. A memory miss that finds its url here reads the
+ * object back into a cache buffer.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "disk.h"
+
+typedef struct
+{
+    uint32_t magic;         // DISK_MAGIC
+    uint32_t url_len;
+    uint64_t size;          // object bytes after url and validators
+    int64_t expires;
+    uint16_t etag_len;      // validators between url and object
+    uint16_t lm_len;
+    uint32_t lifetime;      // seconds fresh when stored, capped, | REC_STRICT
+    uint64_t sum;           // of fields above, a torn header fails it
+} drec_t;
+
+#define REC_STRICT 0x80000000u  // never served once stale, see cfresh
+
+typedef struct dent
+{
+    char *url;
+    unsigned int hash;
+    unsigned int seq;       // segment of record
+    off_t off;              // object offset in segment
+    long size;
+    time_t expires;
+    unsigned int lifetime;              // as in record
+    unsigned short etag_len, lm_len;    // validators right before object
+    struct dent *next;
+} dent_t;
+
+typedef struct dqueue
+{
+    cdata *node;
+    struct dqueue *next;
+} dqueue_t;
+
+static char *disk_dir;
+static int segfd[DISK_MAX_SEGS];    // segment seq lives in segfd[seq % DISK_MAX_SEGS]
+static unsigned int first_seq, next_seq;    // live segments are [first_seq, next_seq)
+static off_t seg_len;               // length of newest segment, writer only
+
+static sem_t mutex;                 // protects index, segfd and stats
+static dent_t **dindex;
+static disk_stats_t stats;
+
+static pthread_mutex_t qmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+static dqueue_t *qhead, *qrear;
+static int qlen;
+
+static void *writer_thread(void *vargp);
+static void append(cdata *p);
+static int write_all(int fd, char *buf, long len, off_t off);
+static int new_segment();
+static void drop_segment(unsigned int seq);
+static off_t scan_segment(unsigned int seq);
+static void index_put(char *url, drec_t *rec, unsigned int seq, off_t off);
+static uint64_t rec_sum(drec_t *rec);
+static unsigned int hash_key(char *url, int len);
+static void seg_path(char *buf, unsigned int seq);
+static int cmp_seq(const void *a, const void *b);
+
+
+int Disk_init(char *dir)
+{
+    DIR *d;
+    struct dirent *e;
+    unsigned int *seqs = NULL, seq;
+    int i, n = 0, cap = 0;
+    char path[MAXLINE], c;
+    pthread_t tid;
+
+    if((d = opendir(dir)) == NULL)
+        return -1;
+    disk_dir = dir;
+    Sem_init(&mutex, 0, 1);
+    dindex = Calloc(DISK_BUCKETS, sizeof(dent_t *));
+    for(i = 0; i < DISK_MAX_SEGS; i++)
+        segfd[i] = -1;
+
+    // Segments are named by sequence number, take them oldest first
+    while((e = readdir(d)) != NULL)
+    {
+        if(sscanf(e->d_name, "%8u.se%c", &seq, &c) != 2 || c != 'g')
+            continue;
+        if(n == cap)
+            seqs = Realloc(seqs, (cap = cap ? 2 * cap : 64) * sizeof(*seqs));
+        seqs[n++] = seq;
+    }
+    closedir(d);
+    if(n > 0)
+        qsort(seqs, n, sizeof(*seqs), cmp_seq);
+
+    // Only the newest DISK_MAX_SEGS are kept
+    for(i = 0; i < n; i++)
+    {
+        if(seqs[i] + DISK_MAX_SEGS <= seqs[n - 1])
+        {
+            seg_path(path, seqs[i]);
+            unlink(path);
+            continue;
+        }
+        if(first_seq == next_seq)
+            first_seq = seqs[i];
+        next_seq = seqs[i] + 1;
+        seg_len = scan_segment(seqs[i]);
+    }
+    Free(seqs);
+
+    // A record cut short by a crash is cut off, appends go on after the rest
+    if(next_seq != first_seq &&
+       (seg_len < 0 || ftruncate(segfd[(next_seq - 1) % DISK_MAX_SEGS], seg_len) < 0))
+        seg_len = DISK_SEG_SIZE;
+
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+    return 0;
+}
+
+int Disk_enabled()
+{
+    return disk_dir != NULL;
+}
+
+void Disk_put(cdata *acache)
+{
+    dqueue_t *q;
+
+    pthread_mutex_lock(&qmutex);
+    if(qlen == DISK_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&qmutex);
+        P(&mutex);
+        stats.dropped++;
+        V(&mutex);
+        Release_cache(acache);
+        return;
+    }
+
+    q = Malloc(sizeof(dqueue_t));
+    q->node = acache;
+    q->next = NULL;
+    if(qrear)
+        qrear->next = q;
+    else
+        qhead = q;
+    qrear = q;
+    qlen++;
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qmutex);
+}
+
+int Disk_load(char *url, cchain *c, cfresh *fr)
+{
+    unsigned int h = hash_key(url, strlen(url));
+    dent_t *p;
+    char buf[DISK_READ_SIZE];
+    off_t off;
+    long size = 0, got;
+    ssize_t n;
+    int fd = -1, etag_len = 0, lm_len = 0;
+
+    // Read from a dup of segment fd, so that it may be dropped meanwhile
+    P(&mutex);
+    for(p = dindex[h & (DISK_BUCKETS - 1)]; p; p = p->next)
+    {
+        if(p->hash == h && strcmp(p->url, url) == 0)
+        {
+            fd = dup(segfd[p->seq % DISK_MAX_SEGS]);
+            off = p->off;
+            size = p->size;
+            fr->expires = p->expires;
+            fr->lifetime = p->lifetime & ~REC_STRICT;
+            fr->strict = (p->lifetime & REC_STRICT) != 0;
+            etag_len = p->etag_len;
+            lm_len = p->lm_len;
+            break;
+        }
+    }
+    V(&mutex);
+    if(fd < 0)
+        return -1;
+
+    if(pread(fd, buf, etag_len + lm_len, off - etag_len - lm_len) != etag_len + lm_len)
+    {
+        close(fd);
+        return -1;
+    }
+    memcpy(fr->etag, buf, etag_len);
+    fr->etag[etag_len] = '\0';
+    memcpy(fr->last_modified, buf + etag_len, lm_len);
+    fr->last_modified[lm_len] = '\0';
+
+    Chain_init(c, size);
+    for(got = 0; got < size; got += n)
+        if((n = pread(fd, buf, size - got < DISK_READ_SIZE ? size - got : DISK_READ_SIZE, off + got)) <= 0 ||
+           Chain_append(c, buf, n) == -1)
+            break;
+    close(fd);
+    if(got < size)
+    {
+        Chain_free(c);
+        return -1;
+    }
+
+    P(&mutex);
+    stats.hits++;
+    stats.hit_bytes += size;
+    V(&mutex);
+    return 0;
+}
+
+void Disk_stats(disk_stats_t *st)
+{
+    P(&mutex);
+    *st = stats;
+    st->segments = next_seq - first_seq;
+    st->table_bytes = DISK_BUCKETS * sizeof(dent_t *);
+    V(&mutex);
+}
+
+// Append queued nodes one at a time and let go of them
+static void *writer_thread(void *vargp)
+{
+    dqueue_t *q;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        pthread_mutex_lock(&qmutex);
+        while(qhead == NULL)
+            pthread_cond_wait(&qcond, &qmutex);
+        q = qhead;
+        if((qhead = q->next) == NULL)
+            qrear = NULL;
+        qlen--;
+        pthread_mutex_unlock(&qmutex);
+
+        append(q->node);
+        Release_cache(q->node);
+        Free(q);
+    }
+    return NULL;
+}
+
+static void append(cdata *p)
+{
+    drec_t rec;
+    struct iovec iov[4];
+    ssize_t need, hlen;
+    off_t off;
+    int i, fd;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_MAGIC;
+    rec.url_len = strlen(p->url);
+    rec.size = p->size;
+    rec.expires = atomic_load(&p->expires);
+    rec.lifetime = atomic_load(&p->lifetime) < REC_STRICT ? atomic_load(&p->lifetime) : REC_STRICT - 1;
+    if(atomic_load(&p->strict))
+        rec.lifetime |= REC_STRICT;
+    rec.etag_len = p->etag ? strlen(p->etag) : 0;
+    rec.lm_len = p->last_modified ? strlen(p->last_modified) : 0;
+    rec.sum = rec_sum(&rec);
+    hlen = sizeof(rec) + rec.url_len + rec.etag_len + rec.lm_len;
+    need = hlen + rec.size;
+
+    // A record never spans segments, one too big for any is not written
+    if(need > DISK_SEG_SIZE)
+    {
+        P(&mutex);
+        stats.oversized++;
+        V(&mutex);
+        return;
+    }
+    if((next_seq == first_seq || seg_len + need > DISK_SEG_SIZE) && new_segment() < 0)
+        return;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = p->url;
+    iov[1].iov_len = rec.url_len;
+    iov[2].iov_base = p->etag;
+    iov[2].iov_len = rec.etag_len;
+    iov[3].iov_base = p->last_modified;
+    iov[3].iov_len = rec.lm_len;
+    fd = segfd[(next_seq - 1) % DISK_MAX_SEGS];
+
+    // Object goes first, header last: a crash never leaves a header in front
+    // of missing bytes
+    off = seg_len + hlen;
+    for(i = 0; i < p->nchunks && write_all(fd, p->chunks[i], p->lens[i], off) == 0; i++)
+        off += p->lens[i];
+    if(i < p->nchunks || pwritev(fd, iov, 4, seg_len) != hlen)
+    {
+        // Leave no partial record behind for the next append to follow
+        if(ftruncate(fd, seg_len) < 0)
+            seg_len = DISK_SEG_SIZE;
+        return;
+    }
+
+    P(&mutex);
+    index_put(p->url, &rec, next_seq - 1, seg_len + hlen);
+    stats.writes++;
+    stats.write_bytes += rec.size;
+    V(&mutex);
+    seg_len += need;
+}
+
+// pwrite all of buf, 0 on success
+static int write_all(int fd, char *buf, long len, off_t off)
+{
+    ssize_t n;
+
+    while(len > 0)
+    {
+        if((n = pwrite(fd, buf, len, off)) <= 0)
+            return -1;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Start next segment, dropping the oldest one if there are too many
+static int new_segment()
+{
+    char path[MAXLINE];
+    int fd;
+
+    seg_path(path, next_seq);
+    if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        fprintf(stderr, "disk cache: cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    P(&mutex);
+    if(next_seq - first_seq == DISK_MAX_SEGS)
+        drop_segment(first_seq++);
+    segfd[next_seq % DISK_MAX_SEGS] = fd;
+    next_seq++;
+    V(&mutex);
+    seg_len = 0;
+    return 0;
+}
+
+// Forget segment seq and the records in it. Mutex held
+static void drop_segment(unsigned int seq)
+{
+    char path[MAXLINE];
+    dent_t **pp, *p;
+    int i;
+
+    for(i = 0; i < DISK_BUCKETS; i++)
+    {
+        for(pp = &dindex[i]; (p = *pp) != NULL; )
+        {
+            if(p->seq == seq)
+            {
+                *pp = p->next;
+                stats.objects--;
+                stats.bytes -= p->size;
+                stats.index_bytes -= sizeof(dent_t) + strlen(p->url) + 1;
+                Free(p->url);
+                Free(p);
+            }
+            else
+                pp = &p->next;
+        }
+    }
+
+    if(segfd[seq % DISK_MAX_SEGS] >= 0)
+        close(segfd[seq % DISK_MAX_SEGS]);
+    segfd[seq % DISK_MAX_SEGS] = -1;
+    seg_path(path, seq);
+    unlink(path);
+}
+
+// Index records of segment seq found on startup, up to the first one that
+// is damaged or cut short. Returns length of good records, -1 on error
+static off_t scan_segment(unsigned int seq)
+{
+    char path[MAXLINE], url[MAXLINE];
+    struct stat st;
+    drec_t rec;
+    off_t off = 0, hlen;
+    int fd;
+
+    seg_path(path, seq);
+    if((fd = open(path, O_RDWR | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    P(&mutex);
+    segfd[seq % DISK_MAX_SEGS] = fd;
+    while(pread(fd, &rec, sizeof(rec), off) == sizeof(rec) &&
+          rec.magic == DISK_MAGIC && rec.sum == rec_sum(&rec) && rec.url_len < MAXLINE &&
+          rec.etag_len < CACHE_VALIDATOR_MAX && rec.lm_len < CACHE_VALIDATOR_MAX &&
+          off + (hlen = sizeof(rec) + rec.url_len + rec.etag_len + rec.lm_len) + (off_t)rec.size <= st.st_size &&
+          pread(fd, url, rec.url_len, off + sizeof(rec)) == rec.url_len)
+    {
+        index_put(url, &rec, seq, off + hlen);
+        off += hlen + rec.size;
+    }
+    V(&mutex);
+    return off;
+}
+
+// Point url at new record rec, its object at off. Later records win.
+// Mutex held
+static void index_put(char *url, drec_t *rec, unsigned int seq, off_t off)
+{
+    int url_len = rec->url_len;
+    unsigned int h = hash_key(url, url_len);
+    dent_t *p;
+
+    for(p = dindex[h & (DISK_BUCKETS - 1)]; p; p = p->next)
+        if(p->hash == h && (int)strlen(p->url) == url_len && !memcmp(p->url, url, url_len))
+            break;
+
+    if(p == NULL)
+    {
+        p = Malloc(sizeof(dent_t));
+        p->url = Malloc(url_len + 1);
+        memcpy(p->url, url, url_len);
+        p->url[url_len] = '\0';
+        p->hash = h;
+        p->next = dindex[h & (DISK_BUCKETS - 1)];
+        dindex[h & (DISK_BUCKETS - 1)] = p;
+        stats.objects++;
+        stats.index_bytes += sizeof(dent_t) + url_len + 1;
+    }
+    else
+        stats.bytes -= p->size;
+
+    p->seq = seq;
+    p->off = off;
+    p->size = rec->size;
+    p->expires = rec->expires;
+    p->lifetime = rec->lifetime;
+    p->etag_len = rec->etag_len;
+    p->lm_len = rec->lm_len;
+    stats.bytes += p->size;
+}
+
+static uint64_t rec_sum(drec_t *rec)
+{
+    return (uint64_t)rec->magic + rec->url_len + rec->size + rec->expires +
+           rec->etag_len + rec->lm_len + rec->lifetime;
+}
+
+static unsigned int hash_key(char *url, int len)
+{
+    unsigned int h = 2166136261u;
+
+    while(len-- > 0)
+    {
+        h ^= (unsigned char)*url++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void seg_path(char *buf, unsigned int seq)
+{
+    snprintf(buf, MAXLINE, "%s/%08u.seg", disk_dir, seq);
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
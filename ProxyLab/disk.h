@@ -0,0 +1,42 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "cache.h"
+
+#define DISK_SEG_SIZE (16 << 20)    // bytes per segment file
+#define DISK_MAX_SEGS 64            // oldest segment is dropped beyond this
+#define DISK_BUCKETS 65536          // hash buckets of index, power of 2
+#define DISK_QUEUE_MAX 1024         // objects waiting to be written
+#define DISK_READ_SIZE 65536        // bytes read at a time into a chain
+#define DISK_MAGIC 0x50585946       // "PXYF", starts every record
+
+// Disk tier statistics
+typedef struct
+{
+    long objects, bytes;        // indexed objects and their size
+    long index_bytes;           // memory of index entries
+    long table_bytes;           // memory of index hash table
+    int segments;
+    long hits, hit_bytes;       // objects read back to memory
+    long writes, write_bytes;   // objects appended
+    long dropped;               // objects not written, queue was full
+    long oversized;             // objects not written, bigger than a segment
+} disk_stats_t;
+
+// Keep cached objects in segment files under dir too. Index is rebuilt
+// from the segments already there and a writer thread is started.
+// Returns -1 if dir cannot be used
+int Disk_init(char *dir);
+int Disk_enabled();
+
+// Queue node to be appended to the current segment. Takes over a
+// reference to node, writer releases it with Release_cache
+void Disk_put(cdata *acache);
+
+// Object of url read into chain c, which is initialized, and its freshness
+// as written into *fr. Returns -1 if url is not on disk
+int Disk_load(char *url, cchain *c, cfresh *fr);
+
+void Disk_stats(disk_stats_t *st);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,167 @@
+/*
+ * Cache of host name resolutions.
+ *
+ * getaddrinfo tells nothing about record TTLs, so a resolved host is kept
+ * for DNS_TTL seconds and a failed one for DNS_NEG_TTL. An expired host is
+ * looked up again by the first thread to need it, meanwhile the others go
+ * on with the old addresses. If that lookup fails the old addresses stay
+ * in use and the lookup is retried after DNS_NEG_TTL. A host seen for the first time is looked up
+ * by one thread while the rest wait for its answer. Lookups run without
+ * any lock held, locks only guard the buckets.
+ */
+
+#include "dns.h"
+
+// States of a host entry
+#define DNS_RESOLVING 0     // first lookup under way
+#define DNS_OK 1
+#define DNS_FAILED 2
+
+typedef struct host
+{
+    char *name;
+    int state;
+    int refreshing;         // a thread is looking up an expired entry again
+    int waiters;            // threads waiting for the first lookup
+    time_t expires;
+    int naddrs;
+    unsigned int next;      // address to hand out next
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    struct host *next_host;
+} host_t;
+
+static host_t *buckets[DNS_BUCKETS];
+static pthread_mutex_t locks[DNS_LOCKS];
+static pthread_cond_t resolved[DNS_LOCKS];     // a first lookup finished
+
+static unsigned int hash_host(char *name);
+static host_t *find_host(unsigned int b, char *name, time_t now);
+static int lookup(char *name, struct in_addr *addrs);
+
+
+void Dns_init()
+{
+    int i;
+
+    memset(buckets, 0, sizeof(buckets));
+    for(i = 0; i < DNS_LOCKS; i++)
+    {
+        pthread_mutex_init(&locks[i], NULL);
+        pthread_cond_init(&resolved[i], NULL);
+    }
+}
+
+int Dns_resolve(char *name, struct in_addr *addr)
+{
+    unsigned int b = hash_host(name);
+    pthread_mutex_t *lock = &locks[b % DNS_LOCKS];
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    time_t now = time(NULL);
+    host_t *h;
+    int n, mine = 0, rc = -1;
+
+    pthread_mutex_lock(lock);
+    if((h = find_host(b, name, now)) == NULL)
+    {
+        h = Calloc(1, sizeof(host_t));
+        h->name = Malloc(strlen(name) + 1);
+        strcpy(h->name, name);
+        h->state = DNS_RESOLVING;
+        h->next_host = buckets[b];
+        buckets[b] = h;
+        mine = 1;
+    }
+    else if(h->state == DNS_RESOLVING)
+    {
+        // Somebody else asked first, wait for its answer
+        h->waiters++;
+        while(h->state == DNS_RESOLVING)
+            pthread_cond_wait(&resolved[b % DNS_LOCKS], lock);
+        h->waiters--;
+    }
+    else if(now >= h->expires && !h->refreshing)
+    {
+        h->refreshing = 1;      // ours to look up again, old answer meanwhile
+        mine = 1;
+    }
+
+    if(mine)
+    {
+        pthread_mutex_unlock(lock);
+        n = lookup(name, addrs);
+        pthread_mutex_lock(lock);
+
+        if(n > 0 || h->state != DNS_OK)
+        {
+            h->state = (n > 0) ? DNS_OK : DNS_FAILED;
+            h->naddrs = n;
+            memcpy(h->addrs, addrs, n * sizeof(struct in_addr));
+            h->expires = now + ((n > 0) ? DNS_TTL : DNS_NEG_TTL);
+        }
+        else
+            h->expires = now + DNS_NEG_TTL;     // keep old answer, try again soon
+        h->refreshing = 0;
+        pthread_cond_broadcast(&resolved[b % DNS_LOCKS]);
+    }
+
+    // Hand out addresses of host in turn
+    h = find_host(b, name, now);
+    if(h && h->state == DNS_OK)
+    {
+        *addr = h->addrs[h->next++ % h->naddrs];
+        rc = 0;
+    }
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+static unsigned int hash_host(char *name)
+{
+    unsigned int h = 2166136261u;
+
+    while(*name)
+    {
+        h ^= (unsigned char)tolower(*name++);
+        h *= 16777619u;
+    }
+    return h & (DNS_BUCKETS - 1);
+}
+
+// Find host in bucket b, freeing entries on the way that expired long ago
+// and nobody uses. Bucket lock held
+static host_t *find_host(unsigned int b, char *name, time_t now)
+{
+    host_t **pp = &buckets[b], *h;
+
+    while((h = *pp) != NULL)
+    {
+        if(strcasecmp(h->name, name) == 0)
+            return h;
+
+        if(h->state != DNS_RESOLVING && !h->refreshing && h->waiters == 0 &&
+           now >= h->expires + DNS_TTL)
+        {
+            *pp = h->next_host;
+            Free(h->name);
+            Free(h);
+        }
+        else
+            pp = &h->next_host;
+    }
+    return NULL;
+}
+
+// Resolve name with getaddrinfo, return number of addresses put in addrs
+static int lookup(char *name, struct in_addr *addrs)
+{
+    struct addrinfo *res, *ai;
+    int n = 0;
+
+    if(Getaddrinfo(name, &res) == -1)
+        return 0;
+    for(ai = res; ai && n < DNS_MAX_ADDRS; ai = ai->ai_next)
+        if(ai->ai_family == AF_INET)
+            addrs[n++] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return n;
+}
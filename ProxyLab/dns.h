@@ -0,0 +1,19 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256         // hash buckets of host names, power of 2
+#define DNS_LOCKS 16            // bucket i is guarded by lock i % DNS_LOCKS
+#define DNS_MAX_ADDRS 4         // addresses kept per host, used in turn
+#define DNS_TTL 60              // seconds a resolved host is trusted
+#define DNS_NEG_TTL 5           // seconds a host that did not resolve is not retried
+
+void Dns_init();
+
+// IPv4 address of host in *addr, from cache or else getaddrinfo. Threads
+// asking for a host being resolved wait for that lookup instead of starting
+// their own. Returns 0, or -1 if host does not resolve
+int Dns_resolve(char *host, struct in_addr *addr);
+
+#endif /* __DNS_H__ */
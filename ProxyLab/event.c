@@ -0,0 +1,901 @@
+/*
+ * Non-blocking, epoll driven connection engine.
+ *
+ * Instead of one thread per browser, every connection is a small state
+ * machine that an event loop advances whenever one of its sockets is ready:
+ *
+ *   CONN_READ_REQUEST -> read request header from browser, look up cache
+ *   CONN_SEND_CACHE   -> hit: write pinned cache node to browser
+ *   CONN_CONNECT      -> miss: wait for non-blocking connect to server
+ *   CONN_SEND_REQUEST -> write rewritten request to server
+ *   CONN_RELAY        -> copy response server -> browser, keep a cache copy
+ *
+ * A response is over once the body its head announces has come, only one
+ * without a length runs until server closes. Browser connection then goes
+ * back to CONN_READ_REQUEST if browser keeps it alive, else the head it
+ * got said Connection: close.
+ *
+ * Each loop thread owns one epoll instance, the listening socket is shared
+ * by all of them (EPOLLEXCLUSIVE wakes a single loop per new connection).
+ * Per core, each loop has a SO_REUSEPORT socket of its own instead, so
+ * there is no shared accept queue, and runs pinned to one core storing
+ * into a cache shard of its own.
+ */
+
+#define _GNU_SOURCE     // accept4, pthread_setaffinity_np
+#include <sched.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include "proxy.h"
+#include "cache.h"
+#include "event.h"
+#include "dns.h"
+#include "refresh.h"
+#include "metrics.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+#define MAX_EVENTS 256
+#define ACCEPT_BACKOFF_MS 100   // out of descriptors: accepting is retried after
+
+enum conn_state
+{
+    CONN_READ_REQUEST,
+    CONN_SEND_CACHE,
+    CONN_CONNECT,
+    CONN_SEND_REQUEST,
+    CONN_RELAY,
+    CONN_CLOSED
+};
+
+typedef struct conn conn_t;
+
+// One socket of a connection, this is what epoll hands back to us
+struct endpoint
+{
+    int fd;
+    unsigned int events;    // events registered with epoll, 0 if not registered
+    conn_t *c;
+};
+
+struct conn
+{
+    int state;
+    struct endpoint browser;
+    struct endpoint server;
+
+    char *req;              // request header read from browser, grows up to
+    int req_len, req_cap;   // max_head_size
+    http_msg_t msg;         // request header parsed as it arrives
+
+    char *url;
+    char *out;              // rewritten request for server
+    int out_len, out_off;
+
+    char *buf;              // response block pending for browser, grows up to
+    int buf_len, buf_off;   // max_head_size while it holds part of the head
+    int buf_cap;
+
+    cchain cache;           // copy of response for cache, dropped once too big
+
+    cdata *hit;             // pinned cache node being sent
+    long hit_off;
+
+    http_msg_t resp;        // response head, parsed as it arrives in buf
+    int got_head;           // resp is whole, buf only gets body from then on
+    long body_left;         // body bytes still to come, -1 until server closes
+    cfresh fr;              // freshness of response, if it is stored
+    int keep;               // browser connection carries another request
+    int complete;           // all of response is in, browser gets rest of buf
+
+    long start;             // us request was read, 0 once answered in full
+    long mark;              // us current step of fetch began
+    int replied;            // server sent first bytes of response
+
+    conn_t *next_closed;
+};
+
+typedef struct
+{
+    int epfd;
+    int listenfd;
+    int core;               // core loop runs on and its cache shard, -1 if any
+    conn_t *closed;         // connections closed in current batch of events
+    long paused;            // us listenfd was taken off epoll, out of descriptors
+} loop_t;
+
+static void *loop_thread(void *vargp);
+static void loops_start(loop_t *loops, int nloops);
+static int listen_reuseport(int port);
+static void loop_run(loop_t *lp);
+static void accept_conns(loop_t *lp);
+static void listen_watch(loop_t *lp, int on);
+static void fatal(char *msg);
+static void watch(loop_t *lp, struct endpoint *ep, unsigned int events);
+static void conn_close(loop_t *lp, conn_t *c);
+static void conn_reset(loop_t *lp, conn_t *c);
+static void conn_done(loop_t *lp, conn_t *c);
+static void server_close(loop_t *lp, conn_t *c);
+static void read_request(loop_t *lp, conn_t *c);
+static void handle_request(loop_t *lp, conn_t *c);
+static int build_request(conn_t *c);
+static int connect_server(char *host, unsigned short port);
+static void finish_connect(loop_t *lp, conn_t *c);
+static void send_request(loop_t *lp, conn_t *c);
+static void send_cache(loop_t *lp, conn_t *c);
+static void relay_read(loop_t *lp, conn_t *c);
+static void relay_write(loop_t *lp, conn_t *c);
+static int start_response(conn_t *c);
+static void insert_response(conn_t *c);
+
+
+void Event_run(int listenfd, int nloops)
+{
+    loop_t *loops;
+    int i;
+
+    if(nloops < 1)
+        nloops = 1;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    loops = Calloc(nloops, sizeof(loop_t));
+    for(i = 0; i < nloops; i++)
+    {
+        loops[i].listenfd = listenfd;
+        loops[i].core = -1;
+    }
+    loops_start(loops, nloops);
+}
+
+void Event_run_per_core(int port, int nloops)
+{
+    loop_t *loops;
+    int i;
+
+    if(nloops < 1)
+        nloops = 1;
+
+    loops = Calloc(nloops, sizeof(loop_t));
+    for(i = 0; i < nloops; i++)
+    {
+        if((loops[i].listenfd = listen_reuseport(port)) < 0)
+            fatal("SO_REUSEPORT listen error");
+        loops[i].core = i;
+    }
+    loops_start(loops, nloops);
+}
+
+// Run loops, the first one in calling thread
+static void loops_start(loop_t *loops, int nloops)
+{
+    pthread_t tid;
+    int i;
+
+    for(i = 1; i < nloops; i++)
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    loop_run(&loops[0]);
+}
+
+// Non-blocking listening socket on port that others may bind too, the
+// kernel hands each connection to one of them
+static int listen_reuseport(int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+       bind(fd, (SA *)&addr, sizeof(addr)) < 0 || listen(fd, LISTENQ) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *loop_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    loop_run((loop_t *)vargp);
+    return NULL;
+}
+
+static void loop_run(loop_t *lp)
+{
+    struct epoll_event events[MAX_EVENTS];
+    cpu_set_t cpus;
+    int i, n;
+
+    // Connections, buffers and cache nodes of loop stay on its core
+    if(lp->core >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(lp->core % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        Cache_local(lp->core);
+    }
+
+    // Without a loop nobody serves the listening socket, give up whole
+    if((lp->epfd = epoll_create1(0)) < 0)
+        fatal("epoll_create1 error");
+    listen_watch(lp, 1);
+
+    while(1)
+    {
+        if((n = epoll_wait(lp->epfd, events, MAX_EVENTS, lp->paused ? ACCEPT_BACKOFF_MS : -1)) < 0)
+        {
+            if(errno != EINTR)
+                unix_error("epoll_wait error");
+            continue;
+        }
+
+        for(i = 0; i < n; i++)
+        {
+            struct endpoint *ep = events[i].data.ptr;
+            conn_t *c;
+
+            if(ep == NULL)
+            {
+                accept_conns(lp);
+                continue;
+            }
+
+            c = ep->c;
+            if(ep->fd < 0)      // server closed earlier in this batch
+                continue;
+            switch(c->state)
+            {
+            case CONN_READ_REQUEST:
+                read_request(lp, c);
+                break;
+            case CONN_SEND_CACHE:
+                send_cache(lp, c);
+                break;
+            case CONN_CONNECT:
+                finish_connect(lp, c);
+                break;
+            case CONN_SEND_REQUEST:
+                send_request(lp, c);
+                break;
+            case CONN_RELAY:
+                if(ep == &c->server)
+                    relay_read(lp, c);
+                else
+                    relay_write(lp, c);
+                break;
+            default:    // closed earlier in this batch
+                break;
+            }
+        }
+
+        // Accept again once some connection let go of its descriptors, or
+        // others may have after a while
+        if(lp->paused && (lp->closed || Metrics_now() - lp->paused >= ACCEPT_BACKOFF_MS * 1000L))
+            listen_watch(lp, 1);
+
+        // Nothing of this batch can refer to closed connections any more
+        while(lp->closed)
+        {
+            conn_t *c = lp->closed;
+            lp->closed = c->next_closed;
+            Free(c);
+        }
+    }
+}
+
+// Add listening socket to epoll of loop, or take it off. data.ptr == NULL
+// marks it. EPOLLEXCLUSIVE can not be modified, so it is deleted and added
+static void listen_watch(loop_t *lp, int on)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if(on)
+    {
+        if(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev) < 0)
+            fatal("epoll_ctl listenfd error");
+        lp->paused = 0;
+    }
+    else
+    {
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, lp->listenfd, &ev);
+        lp->paused = Metrics_now();
+    }
+}
+
+static void fatal(char *msg)
+{
+    unix_error(msg);
+    exit(1);
+}
+
+static void accept_conns(loop_t *lp)
+{
+    conn_t *c;
+    int fd, one = 1;
+
+    while(1)
+    {
+        if((fd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                // Listening socket stays readable: stop watching it rather
+                // than spin on it until descriptors are free again
+                unix_error("accept4 error, pausing");
+                listen_watch(lp, 0);
+            }
+            else if(errno != EAGAIN && errno != EWOULDBLOCK)
+                unix_error("accept4 error");
+            return;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));     // as in proxy.c
+
+        c = Calloc(1, sizeof(conn_t));
+        c->state = CONN_READ_REQUEST;
+        c->browser.fd = fd;
+        c->browser.c = c;
+        c->req = Malloc(MAXLINE);
+        c->req_cap = MAXLINE;
+        c->server.fd = -1;
+        c->server.c = c;
+        http_init(&c->msg, HTTP_REQUEST);
+        watch(lp, &c->browser, EPOLLIN);
+    }
+}
+
+// Register interest in events for an endpoint, events == 0 removes it from
+// epoll so that a hangup can not keep waking us for a socket we ignore
+static void watch(loop_t *lp, struct endpoint *ep, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if(ep->fd < 0 || ep->events == events)
+        return;
+
+    if(events == 0)
+        op = EPOLL_CTL_DEL;
+    else if(ep->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    ev.events = events;
+    ev.data.ptr = ep;
+    if(epoll_ctl(lp->epfd, op, ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->events = events;
+}
+
+// Release everything a connection holds, memory of conn itself is freed
+// after the current batch of events
+static void conn_close(loop_t *lp, conn_t *c)
+{
+    if(c->start)
+        Metrics_count(METRIC_ERRORS, 1);
+    if(c->browser.fd >= 0)
+        close(c->browser.fd);
+    if(c->server.fd >= 0)
+        close(c->server.fd);
+    if(c->hit)
+        Release_cache(c->hit);
+    if(c->url)
+        Free(c->url);
+    if(c->out)
+        Free(c->out);
+    if(c->buf)
+        Free(c->buf);
+    Chain_free(&c->cache);
+    Free(c->req);
+
+    c->state = CONN_CLOSED;
+    c->next_closed = lp->closed;
+    lp->closed = c;
+}
+
+// Response of c went out in full: wait for the next request if browser
+// keeps the connection, else close it
+static void conn_done(loop_t *lp, conn_t *c)
+{
+    if(c->start)
+        Metrics_since(METRIC_TOTAL, c->start);
+    c->start = 0;
+    if(c->keep)
+        conn_reset(lp, c);
+    else
+        conn_close(lp, c);
+}
+
+// Drop everything of the last request of c but the browser connection and
+// bytes browser sent after that request
+static void conn_reset(loop_t *lp, conn_t *c)
+{
+    int left = c->req_len - c->msg.head_len;
+
+    server_close(lp, c);
+    if(c->hit)
+        Release_cache(c->hit);
+    if(c->url)
+        Free(c->url);
+    if(c->out)
+        Free(c->out);
+    if(c->buf)
+        Free(c->buf);
+    Chain_free(&c->cache);
+
+    memmove(c->req, c->req + c->msg.head_len, left);
+    c->req_len = left;
+    http_init(&c->msg, HTTP_REQUEST);
+    c->hit = NULL;
+    c->url = c->out = c->buf = NULL;
+    c->out_len = c->out_off = c->buf_len = c->buf_off = 0;
+    c->hit_off = c->mark = 0;
+    c->got_head = c->replied = c->complete = 0;
+
+    c->state = CONN_READ_REQUEST;
+    watch(lp, &c->browser, EPOLLIN);
+    if(left > 0)
+        read_request(lp, c);
+}
+
+// Done with server of c, response is whole or will not be
+static void server_close(loop_t *lp, conn_t *c)
+{
+    if(c->server.fd < 0)
+        return;
+    watch(lp, &c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+}
+
+// Read request header from browser until the empty line, parsing whatever
+// arrived after every read
+static void read_request(loop_t *lp, conn_t *c)
+{
+    int n, rc;
+
+    while(1)
+    {
+        // A pipelined request may be there before anything is read
+        if(c->req_len > 0 && (rc = http_parse(&c->msg, c->req, c->req_len)) != HTTP_AGAIN)
+        {
+            if(rc == HTTP_DONE)
+                handle_request(lp, c);
+            else
+                conn_close(lp, c);
+            return;
+        }
+        // Spans are offsets, the header may move as it grows
+        if(c->req_len == c->req_cap)
+        {
+            if(c->req_cap >= max_head_size())
+            {
+                send_status(c->browser.fd, 431);
+                conn_close(lp, c);
+                return;
+            }
+            c->req_cap = (2L * c->req_cap < max_head_size()) ? 2 * c->req_cap : max_head_size();
+            c->req = Realloc(c->req, c->req_cap);
+        }
+
+        n = read(c->browser.fd, c->req + c->req_len, c->req_cap - c->req_len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(lp, c);
+            return;
+        }
+        if(n == 0)
+        {
+            conn_close(lp, c);
+            return;
+        }
+        c->req_len += n;
+    }
+}
+
+// Whole request header is in c->req: serve it from cache or start a fetch
+static void handle_request(loop_t *lp, conn_t *c)
+{
+    http_msg_t *m = &c->msg;
+    char host[MAXLINE];
+    int state = CACHE_FRESH;
+
+    // Ignore non-get methods
+    if(!http_span_is(c->req, m->method, "GET"))
+    {
+        fprintf(stderr, "Only GET method is supported\n");
+        conn_close(lp, c);
+        return;
+    }
+
+    // Only HTTP/1.1 browsers get a persistent connection, as in threads mode
+    c->keep = m->minor >= 1 && m->conn != HTTP_CONN_CLOSE;
+
+    // Request for the proxy itself, sent like the last block of a response
+    // without server to read from
+    if(is_status_request(c->req, m, c->browser.fd))
+    {
+        watch(lp, &c->browser, 0);
+        c->buf = status_response(&c->buf_len);
+        c->complete = 1;
+        c->state = CONN_RELAY;
+        relay_write(lp, c);
+        return;
+    }
+    c->start = Metrics_now();
+    Metrics_count(METRIC_REQUESTS, 1);
+
+    // Cache key is the absolute url even if browser sent the path alone
+    if(m->host.len == 0 || m->host.len >= MAXLINE || m->url.len + m->host.len + 16 >= MAXLINE)
+    {
+        conn_close(lp, c);
+        return;
+    }
+    sprintf(host, "%.*s", m->host.len, HTTP_PTR(c->req, m->host));
+    c->url = Malloc(MAXLINE);
+    if(m->path.off == m->url.off)
+        snprintf(c->url, MAXLINE, "http://%.*s:%d%.*s", m->host.len, HTTP_PTR(c->req, m->host), m->port, m->path.len, HTTP_PTR(c->req, m->path));
+    else
+        sprintf(c->url, "%.*s", m->url.len, HTTP_PTR(c->req, m->url));
+
+    watch(lp, &c->browser, 0);
+
+    // Check whether in cache and fresh. Stale copies are fetched again in
+    // full, revalidation is left to threads mode and refresher threads
+    if((c->hit = Lookup_cache(c->url)) != NULL && (state = Cache_check(c->hit)) == CACHE_STALE)
+    {
+        Release_cache(c->hit);
+        c->hit = NULL;
+    }
+    if(c->hit != NULL)
+    {
+        if(state == CACHE_DUE)
+            Refresh_put(c->hit);
+        Metrics_count(METRIC_HITS, 1);
+        c->state = CONN_SEND_CACHE;
+        send_cache(lp, c);
+        return;
+    }
+
+    Metrics_count(METRIC_MISSES, 1);
+    if(build_request(c) == -1)
+    {
+        conn_close(lp, c);
+        return;
+    }
+
+    c->mark = Metrics_now();
+    if((c->server.fd = connect_server(host, m->port)) < 0)
+    {
+        fprintf(stderr, "connect_server error\n");
+        conn_close(lp, c);
+        return;
+    }
+    c->state = CONN_CONNECT;
+    watch(lp, &c->server, EPOLLOUT);
+}
+
+// Rewrite browser request for server: HTTP/1.0 request line, browser headers
+// except the connection management ones, which are replaced by our own:
+// server connections are not pooled here, each carries one request
+static int build_request(conn_t *c)
+{
+    http_msg_t *m = &c->msg;
+    http_header_t *h;
+    int i;
+
+    c->out = Malloc(m->head_len + m->path.len + MAXLINE + 64);
+    c->out_len = sprintf(c->out, "GET %s%.*s HTTP/1.0\r\n",
+                         (m->path.len > 0 && c->req[m->path.off] == '/') ? "" : "/",
+                         m->path.len, HTTP_PTR(c->req, m->path));
+    c->out_off = 0;
+
+    for(i = 0; i < m->nheaders; i++)
+    {
+        h = &m->headers[i];
+        if(h->kind == HTTP_H_HOP)
+            continue;
+        memcpy(c->out + c->out_len, HTTP_PTR(c->req, h->line), h->line.len);
+        c->out_len += h->line.len;
+    }
+    if(!m->has_host)
+        c->out_len += sprintf(c->out + c->out_len, "Host: %.*s:%d\r\n",
+                              m->host.len, HTTP_PTR(c->req, m->host), m->port);
+
+    c->out_len += sprintf(c->out + c->out_len, "Connection: close\r\n\r\n");
+    return 0;
+}
+
+// Start a non-blocking connect to server, returns socket or -1
+static int connect_server(char *host, unsigned short port)
+{
+    struct sockaddr_in serveraddr;
+    int fd;
+
+    // Only a host not in DNS cache blocks the loop
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+    if(Dns_resolve(host, &serveraddr.sin_addr) == -1)
+        return -1;
+
+    if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+
+    if(connect(fd, (SA *) &serveraddr, sizeof(serveraddr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void finish_connect(loop_t *lp, conn_t *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        fprintf(stderr, "connect error: %s\n", strerror(err ? err : errno));
+        conn_close(lp, c);
+        return;
+    }
+    Metrics_count(METRIC_CONNECTS, 1);
+    Metrics_since(METRIC_CONNECT, c->mark);
+
+    c->state = CONN_SEND_REQUEST;
+    send_request(lp, c);
+}
+
+static void send_request(loop_t *lp, conn_t *c)
+{
+    int n;
+
+    while(c->out_off < c->out_len)
+    {
+        if((n = write(c->server.fd, c->out + c->out_off, c->out_len - c->out_off)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                watch(lp, &c->server, EPOLLOUT);
+            else
+                conn_close(lp, c);
+            return;
+        }
+        c->out_off += n;
+    }
+
+    Free(c->out);
+    c->out = NULL;
+
+    // Request is out, wait for response
+    c->mark = Metrics_now();
+    c->buf = Malloc(MAXBUF);
+    c->buf_cap = MAXBUF;
+    http_init(&c->resp, HTTP_RESPONSE);
+    Chain_init(&c->cache, Cache_max_object());
+    c->state = CONN_RELAY;
+    watch(lp, &c->server, EPOLLIN);
+}
+
+static void send_cache(loop_t *lp, conn_t *c)
+{
+    int n;
+
+    while(c->hit_off < c->hit->size)
+    {
+        if((n = Send_cache(c->hit, c->browser.fd, &c->hit_off, c->hit->size)) <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                watch(lp, &c->browser, EPOLLOUT);
+            else
+                conn_close(lp, c);
+            return;
+        }
+    }
+    Metrics_since(METRIC_HIT, c->start);
+    conn_done(lp, c);
+}
+
+// Server is readable: take one block of response, only when browser has
+// consumed the previous one. Until the head is whole, blocks pile up in buf
+static void relay_read(loop_t *lp, conn_t *c)
+{
+    int n;
+
+    if((n = read(c->server.fd, c->buf + c->buf_len, c->buf_cap - c->buf_len)) < 0)
+    {
+        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            conn_close(lp, c);
+        return;
+    }
+
+    // Server closed connection: only a response without a length is
+    // complete, anything else was cut short and is neither stored nor ends
+    // cleanly for browser. Stored copy gets a length, hits go out on
+    // persistent connections
+    if(n == 0)
+    {
+        if(!c->got_head || c->body_left >= 0)
+        {
+            conn_close(lp, c);
+            return;
+        }
+        if(c->cache.bufs && c->cache.size > 0)
+            add_content_length(&c->cache);
+        if(c->cache.bufs)
+            insert_response(c);
+        if(c->replied)
+            Metrics_since(METRIC_TRANSFER, c->mark);
+        c->complete = 1;
+        server_close(lp, c);
+        relay_write(lp, c);
+        return;
+    }
+    if(!c->replied)
+    {
+        c->replied = 1;
+        c->mark = Metrics_since(METRIC_TTFB, c->mark);
+    }
+
+    if(!c->got_head)
+    {
+        c->buf_len += n;
+        switch(http_parse(&c->resp, c->buf, c->buf_len))
+        {
+        case HTTP_AGAIN:
+            if(c->buf_len == c->buf_cap)
+            {
+                // Nothing went to browser yet, it learns why
+                if(c->buf_cap >= max_head_size())
+                {
+                    send_status(c->browser.fd, 502);
+                    conn_close(lp, c);
+                    return;
+                }
+                c->buf_cap = (2L * c->buf_cap < max_head_size()) ? 2 * c->buf_cap : max_head_size();
+                c->buf = Realloc(c->buf, c->buf_cap);
+            }
+            return;
+        case HTTP_ERROR:
+            conn_close(lp, c);
+            return;
+        }
+        n = start_response(c);
+    }
+    else
+    {
+        // Nothing beyond the announced body belongs to the response
+        if(c->body_left >= 0 && n > c->body_left)
+            n = c->body_left;
+        Chain_append(&c->cache, c->buf, n);     // dropped once too big
+        c->buf_len = n;
+    }
+
+    if(c->body_left > 0)
+        c->body_left -= n;
+    if(c->body_left == 0)
+    {
+        if(c->cache.bufs)
+            insert_response(c);
+        Metrics_since(METRIC_TRANSFER, c->mark);
+        c->complete = 1;
+        server_close(lp, c);
+    }
+
+    c->buf_off = 0;
+    relay_write(lp, c);
+}
+
+// Whole response head is at the start of buf: find out how its body ends,
+// rewrite head for browser without hop-by-hop lines, store it for cache if
+// the response may be stored. Returns body bytes that came with the head
+static int start_response(conn_t *c)
+{
+    http_msg_t *m = &c->resp;
+    int i, from, to, len = 0, body = c->buf_len - m->head_len;
+    char *out;
+
+    c->got_head = 1;
+    if(m->status / 100 == 1 || m->status == 204 || m->status == 304)
+        c->body_left = 0;
+    else if(m->chunked)
+        c->body_left = -1;      // relayed as it is until server closes, not stored
+    else
+        c->body_left = m->content_length;
+    if(c->body_left >= 0 && body > c->body_left)
+        body = c->body_left;
+
+    // Browser can only tell where a body without length ends by the close
+    if(c->body_left < 0)
+        c->keep = 0;
+
+    if(m->chunked || cache_freshness(c->buf, m, &c->fr, http_find(&c->msg, HTTP_H_AUTHORIZATION) != NULL) == -1)
+        Chain_free(&c->cache);
+    else
+        write_head(c->buf, m, 1 << HTTP_H_HOP, -1, &c->cache, c->buf + m->head_len, body);
+
+    // Head may have grown beyond a block, later blocks are read into out too
+    c->buf_cap = (c->buf_len > MAXBUF ? c->buf_len : MAXBUF) + 32;
+    out = Malloc(c->buf_cap);
+    for(from = 0, i = 0; i <= m->nheaders; i++)
+    {
+        if(i < m->nheaders && m->headers[i].kind != HTTP_H_HOP)
+            continue;
+        to = (i < m->nheaders) ? m->headers[i].line.off : m->head_len - 2;
+        memcpy(out + len, c->buf + from, to - from);
+        len += to - from;
+        if(i < m->nheaders)
+            from = to + m->headers[i].line.len;
+    }
+    if(!c->keep)
+        len += sprintf(out + len, "Connection: close\r\n");
+    memcpy(out + len, "\r\n", 2);
+    memcpy(out + len + 2, c->buf + m->head_len, body);
+
+    Free(c->buf);
+    c->buf = out;
+    c->buf_len = len + 2 + body;
+    return body;
+}
+
+// Store complete response of c in cache, freshness was worked out from its
+// head as it came
+static void insert_response(conn_t *c)
+{
+    Insert_cache(c->url, &c->cache, &c->fr);   // adopted by cache
+}
+
+// Browser is writable (or a new block arrived): push pending block
+static void relay_write(loop_t *lp, conn_t *c)
+{
+    int n;
+
+    while(c->buf_off < c->buf_len)
+    {
+        if((n = write(c->browser.fd, c->buf + c->buf_off, c->buf_len - c->buf_off)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Stop reading server until browser catches up
+                watch(lp, &c->server, 0);
+                watch(lp, &c->browser, EPOLLOUT);
+            }
+            else
+                conn_close(lp, c);
+            return;
+        }
+        c->buf_off += n;
+    }
+
+    c->buf_len = c->buf_off = 0;
+    if(c->complete)
+    {
+        conn_done(lp, c);
+        return;
+    }
+    watch(lp, &c->browser, 0);
+    watch(lp, &c->server, EPOLLIN);
+}
@@ -0,0 +1,15 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+
+// Serve connections accepted on listenfd with nloops non-blocking epoll
+// loops, one thread each (the caller runs the first one). Never returns.
+void Event_run(int listenfd, int nloops);
+
+// Like Event_run, but each loop accepts on a SO_REUSEPORT socket of its own
+// bound to port, so the kernel spreads connections over loops, and runs
+// pinned to a core of its own, storing into cache shard of its index
+void Event_run_per_core(int port, int nloops);
+
+#endif /* __EVENT_H__ */
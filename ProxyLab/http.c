@@ -0,0 +1,584 @@
+/*
+ * Incremental HTTP/1.x head parser.
+ *
+ * A head is taken one complete line at a time: memchr finds the line end,
+ * then the line is split into spans in one pass. Where the next line starts
+ * and how far the search for its end got are kept in the message, so a head
+ * arriving in many small reads is still only scanned once, and the caller's
+ * buffer may be reallocated or compacted between calls.
+ */
+
+#include <stddef.h>
+#include "http.h"
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+// Parser states
+#define S_FIRST 0       // request or status line next
+#define S_HEADERS 1     // header line or empty line next
+#define S_DONE 2
+
+static int parse_request_line(http_msg_t *m, const char *buf, int off, int len);
+static int parse_status_line(http_msg_t *m, const char *buf, int off, int len);
+static int parse_version(http_msg_t *m, const char *p, int len);
+static int parse_authority(http_msg_t *m, const char *buf, int off, int len);
+static int parse_header(http_msg_t *m, const char *buf, int off, int len, int line_len);
+static int parse_conn(const char *buf, http_span_t v);
+static int has_token(const char *buf, http_span_t v, const char *token);
+static int directive(const char *buf, http_span_t v, const char *name, long *arg_p);
+static long parse_number(const char *p, const char *end);
+
+
+void http_init(http_msg_t *m, int type)
+{
+    memset(m, 0, offsetof(http_msg_t, headers));
+    m->type = type;
+    m->state = S_FIRST;
+    m->port = 80;
+    m->content_length = -1;
+    m->conn = HTTP_CONN_DEFAULT;
+}
+
+int http_parse(http_msg_t *m, const char *buf, int len)
+{
+    const char *lf;
+    int off, end;
+
+    while(m->state != S_DONE)
+    {
+        if(m->pos + m->scan >= len ||
+           (lf = memchr(buf + m->pos + m->scan, '\n', len - m->pos - m->scan)) == NULL)
+        {
+            m->scan = len - m->pos;
+            return HTTP_AGAIN;
+        }
+
+        // Line is [off, end) without its CRLF or bare LF
+        off = m->pos;
+        end = lf - buf;
+        m->pos = end + 1;
+        m->scan = 0;
+        if(end > off && buf[end - 1] == '\r')
+            end--;
+
+        if(m->state == S_FIRST)
+        {
+            if(end == off && m->type == HTTP_REQUEST)
+                continue;   // empty lines ahead of a request are ignored
+            if(m->type == HTTP_REQUEST ? parse_request_line(m, buf, off, end - off)
+                                       : parse_status_line(m, buf, off, end - off))
+                return HTTP_ERROR;
+            m->state = S_HEADERS;
+        }
+        else if(end == off)
+        {
+            m->head_len = m->pos;
+            m->state = S_DONE;
+        }
+        else if(parse_header(m, buf, off, end - off, m->pos - off))
+            return HTTP_ERROR;
+    }
+
+    // Origin form request, eg: GET /index.html, names host in Host header
+    if(m->type == HTTP_REQUEST && m->host.len == 0)
+    {
+        int i;
+        for(i = 0; i < m->nheaders; i++)
+            if(m->headers[i].kind == HTTP_H_HOST)
+                return parse_authority(m, buf, m->headers[i].value.off,
+                                       m->headers[i].value.len) ? HTTP_ERROR : HTTP_DONE;
+    }
+    return HTTP_DONE;
+}
+
+int http_span_is(const char *buf, http_span_t span, const char *s)
+{
+    return (int)strlen(s) == span.len && !strncasecmp(buf + span.off, s, span.len);
+}
+
+http_header_t *http_find(http_msg_t *m, int kind)
+{
+    int i;
+
+    for(i = 0; i < m->nheaders; i++)
+        if(m->headers[i].kind == kind)
+            return &m->headers[i];
+    return NULL;
+}
+
+// Statuses that may be stored unless told otherwise, see RFC 9110 15.1.
+// Partial and not modified responses are not whole objects. Any Vary would
+// need the request headers it names as part of the key, see RFC 9111 4.1,
+// and a response to an authorized request is only shared if it says so, 3.5
+int http_cacheable(http_msg_t *m, const char *buf, int authorized)
+{
+    http_header_t *h;
+    int i;
+
+    switch(m->status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        break;
+    default:
+        return 0;
+    }
+    if(http_find(m, HTTP_H_VARY))
+        return 0;
+    if(!authorized)
+        return 1;
+
+    for(i = 0; i < m->nheaders; i++)
+    {
+        h = &m->headers[i];
+        if(h->kind == HTTP_H_CACHE_CONTROL &&
+           (directive(buf, h->value, "public", NULL) || directive(buf, h->value, "s-maxage", NULL) ||
+            directive(buf, h->value, "must-revalidate", NULL)))
+            return 1;
+    }
+    return 0;
+}
+
+long http_freshness(http_msg_t *m, const char *buf, time_t now, int *strict_p)
+{
+    long max_age = -1, s_maxage = -1, age = 0, life, arg;
+    int i, no_cache = 0;
+    http_header_t *h;
+    time_t date, t;
+
+    *strict_p = 0;
+
+    for(i = 0; i < m->nheaders; i++)
+    {
+        h = &m->headers[i];
+        if(h->kind != HTTP_H_CACHE_CONTROL)
+            continue;
+        if(directive(buf, h->value, "no-store", NULL) || directive(buf, h->value, "private", NULL))
+            return -1;
+        if(directive(buf, h->value, "no-cache", NULL))
+            no_cache = 1;
+        if(directive(buf, h->value, "max-age", &arg))
+            max_age = arg;
+        if(directive(buf, h->value, "s-maxage", &arg))
+            s_maxage = arg;
+        if(directive(buf, h->value, "must-revalidate", NULL) ||
+           directive(buf, h->value, "proxy-revalidate", NULL))
+            *strict_p = 1;
+    }
+    if(no_cache)
+    {
+        *strict_p = 1;
+        return 0;
+    }
+
+    if((h = http_find(m, HTTP_H_AGE)) != NULL &&
+       (age = parse_number(HTTP_PTR(buf, h->value), HTTP_PTR(buf, h->value) + h->value.len)) < 0)
+        age = 0;
+    if((h = http_find(m, HTTP_H_DATE)) == NULL || (date = http_date(buf, h->value)) == -1)
+        date = now;
+
+    // A shared cache goes by s-maxage first. Expires that is not a date
+    // means already expired
+    if(s_maxage >= 0)
+        life = s_maxage;
+    else if(max_age >= 0)
+        life = max_age;
+    else if((h = http_find(m, HTTP_H_EXPIRES)) != NULL)
+        life = (t = http_date(buf, h->value)) == -1 ? 0 : t - date;
+    else if((h = http_find(m, HTTP_H_LAST_MODIFIED)) != NULL && (t = http_date(buf, h->value)) != -1)
+    {
+        // A tenth of the time since it last changed
+        life = (date - t) / 10;
+        if(life > HTTP_HEURISTIC_MAX)
+            life = HTTP_HEURISTIC_MAX;
+    }
+    else
+        life = HTTP_DEFAULT_TTL;
+
+    life -= age;
+    if(life <= 0)
+    {
+        *strict_p = 1;
+        return 0;
+    }
+    return life;
+}
+
+// eg: bytes=0-499, bytes=500-, bytes=-500 (the last 500)
+int http_range(const char *buf, http_span_t v, long size, long *first_p, long *last_p)
+{
+    const char *p = buf + v.off, *end = p + v.len, *dash;
+    long first, last;
+
+    if(v.len < 8 || strncasecmp(p, "bytes=", 6) || memchr(p, ',', v.len))
+        return 1;
+    p += 6;
+    if((dash = memchr(p, '-', end - p)) == NULL)
+        return 1;
+
+    if(dash == p)
+    {
+        if((last = parse_number(dash + 1, end)) < 0)
+            return 1;
+        if(last == 0 || size == 0)
+            return -1;
+        *first_p = (last >= size) ? 0 : size - last;
+        *last_p = size - 1;
+        return 0;
+    }
+
+    if((first = parse_number(p, dash)) < 0)
+        return 1;
+    if(dash + 1 == end)
+        last = size - 1;
+    else if((last = parse_number(dash + 1, end)) < 0 || last < first)
+        return 1;
+    if(first >= size)
+        return -1;
+    *first_p = first;
+    *last_p = (last < size) ? last : size - 1;
+    return 0;
+}
+
+time_t http_date(const char *buf, http_span_t v)
+{
+    static const char *form = "xxx, 00 xxx 0000 00:00:00 GMT";
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *p = buf + v.off;
+    long y, mon, d, era, yoe, doy, doe;
+    int i;
+
+    // x is any letter, 0 any digit, the rest as it is
+    if(v.len != (int)strlen(form))
+        return -1;
+    for(i = 0; i < v.len; i++)
+        if(form[i] == '0' ? !IS_DIGIT(p[i]) : form[i] != 'x' && form[i] != p[i])
+            return -1;
+    for(mon = 0; mon < 12 && strncmp(months + 3 * mon, p + 8, 3); mon++)
+        ;
+    if(mon++ == 12)
+        return -1;
+    d = (p[5] - '0') * 10 + (p[6] - '0');
+    y = parse_number(p + 12, p + 16);
+
+    // Days since 1970-01-01, counting years from March so that leap days
+    // come last
+    y -= mon <= 2;
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (time_t)(era * 146097 + doe - 719468) * 86400 +
+           parse_number(p + 17, p + 19) * 3600 + parse_number(p + 20, p + 22) * 60 +
+           parse_number(p + 23, p + 25);
+}
+
+// eg: GET http://www.cmu.edu:8080/index.html HTTP/1.1
+static int parse_request_line(http_msg_t *m, const char *buf, int off, int len)
+{
+    const char *p = buf + off, *sp1, *sp2;
+
+    if((sp1 = memchr(p, ' ', len)) == NULL || sp1 == p)
+        return -1;
+    if((sp2 = memchr(sp1 + 1, ' ', p + len - sp1 - 1)) == NULL || sp2 == sp1 + 1)
+        return -1;
+
+    m->method.off = off;
+    m->method.len = sp1 - p;
+    m->url.off = sp1 + 1 - buf;
+    m->url.len = sp2 - sp1 - 1;
+    if(parse_version(m, sp2 + 1, p + len - sp2 - 1))
+        return -1;
+
+    p = buf + m->url.off;
+    if(m->url.len > 7 && !strncasecmp(p, "http://", 7))
+    {
+        // Absolute form: authority up to the path, path may be empty
+        int a = 7;
+        while(a < m->url.len && p[a] != '/' && p[a] != '?')
+            a++;
+        m->path.off = m->url.off + a;
+        m->path.len = m->url.len - a;
+        return parse_authority(m, buf, m->url.off + 7, a - 7);
+    }
+    if(p[0] != '/' && !(m->url.len == 1 && p[0] == '*'))
+        return -1;
+    m->path = m->url;
+    return 0;
+}
+
+// eg: HTTP/1.1 200 OK, reason may be empty
+static int parse_status_line(http_msg_t *m, const char *buf, int off, int len)
+{
+    const char *p = buf + off;
+
+    if(len < 12 || p[8] != ' ' || parse_version(m, p, 8))
+        return -1;
+    if(!IS_DIGIT(p[9]) || !IS_DIGIT(p[10]) || !IS_DIGIT(p[11]) || (len > 12 && p[12] != ' '))
+        return -1;
+    m->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    return 0;
+}
+
+static int parse_version(http_msg_t *m, const char *p, int len)
+{
+    if(len != 8 || strncmp(p, "HTTP/1.", 7) || !IS_DIGIT(p[7]))
+        return -1;
+    m->minor = p[7] - '0';
+    return 0;
+}
+
+// host[:port] of url or Host header, userinfo@ is skipped
+static int parse_authority(http_msg_t *m, const char *buf, int off, int len)
+{
+    const char *p = buf + off, *at, *end = buf + off + len, *colon = NULL;
+    long port = 0;
+
+    while((at = memchr(p, '@', end - p)) != NULL)
+        p = at + 1;
+
+    if(p < end && *p == '[')
+    {
+        // IPv6 literal, port only after the closing bracket
+        const char *rb = memchr(p, ']', end - p);
+        if(rb == NULL)
+            return -1;
+        if(rb + 1 < end)
+        {
+            if(rb[1] != ':')
+                return -1;
+            colon = rb + 1;
+        }
+    }
+    else
+        colon = memchr(p, ':', end - p);
+
+    if(colon)
+    {
+        if(colon + 1 == end || colon + 6 < end)
+            return -1;
+        for(at = colon + 1; at < end; at++)
+        {
+            if(!IS_DIGIT(*at))
+                return -1;
+            port = port * 10 + (*at - '0');
+        }
+        if(port == 0 || port > 65535)
+            return -1;
+        m->port = port;
+        end = colon;
+    }
+
+    if(end == p)
+        return -1;
+    m->host.off = p - buf;
+    m->host.len = end - p;
+    return 0;
+}
+
+// name: value, classified as the proxy cares about it
+static int parse_header(http_msg_t *m, const char *buf, int off, int len, int line_len)
+{
+    http_header_t *h;
+    const char *p = buf + off, *colon;
+    int i, vs, ve;
+    long n;
+
+    if(m->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+
+    // Name ends at colon, obsolete line folding and white space before
+    // colon are rejected
+    for(colon = p; colon < p + len && *colon != ':'; colon++)
+        if((unsigned char)*colon <= ' ' || *colon == 127)
+            return -1;
+    if(colon == p + len || colon == p)
+        return -1;
+
+    vs = colon + 1 - p;
+    ve = len;
+    while(vs < ve && (p[vs] == ' ' || p[vs] == '\t'))
+        vs++;
+    while(ve > vs && (p[ve - 1] == ' ' || p[ve - 1] == '\t'))
+        ve--;
+
+    h = &m->headers[m->nheaders++];
+    h->kind = HTTP_H_OTHER;
+    h->line.off = off;
+    h->line.len = line_len;
+    h->name.off = off;
+    h->name.len = colon - p;
+    h->value.off = off + vs;
+    h->value.len = ve - vs;
+
+    switch(h->name.len)
+    {
+    case 3:
+        if(http_span_is(buf, h->name, "Age"))
+            h->kind = HTTP_H_AGE;
+        break;
+    case 4:
+        if(http_span_is(buf, h->name, "Host"))
+        {
+            h->kind = HTTP_H_HOST;
+            m->has_host = 1;
+        }
+        else if(http_span_is(buf, h->name, "Date"))
+            h->kind = HTTP_H_DATE;
+        else if(http_span_is(buf, h->name, "ETag"))
+            h->kind = HTTP_H_ETAG;
+        else if(http_span_is(buf, h->name, "Vary"))
+            h->kind = HTTP_H_VARY;
+        break;
+    case 5:
+        if(http_span_is(buf, h->name, "Range"))
+            h->kind = HTTP_H_RANGE;
+        break;
+    case 7:
+        if(http_span_is(buf, h->name, "Expires"))
+            h->kind = HTTP_H_EXPIRES;
+        break;
+    case 8:
+        if(http_span_is(buf, h->name, "If-Range"))
+            h->kind = HTTP_H_IF_RANGE;
+        break;
+    case 10:
+        if(http_span_is(buf, h->name, "Connection"))
+        {
+            h->kind = HTTP_H_HOP;
+            m->conn = parse_conn(buf, h->value);
+        }
+        else if(http_span_is(buf, h->name, "Keep-Alive"))
+            h->kind = HTTP_H_HOP;
+        break;
+    case 13:
+        if(http_span_is(buf, h->name, "Cache-Control"))
+            h->kind = HTTP_H_CACHE_CONTROL;
+        else if(http_span_is(buf, h->name, "Last-Modified"))
+            h->kind = HTTP_H_LAST_MODIFIED;
+        else if(http_span_is(buf, h->name, "If-None-Match"))
+            h->kind = HTTP_H_CONDITIONAL;
+        else if(http_span_is(buf, h->name, "Authorization"))
+            h->kind = HTTP_H_AUTHORIZATION;
+        break;
+    case 14:
+        if(http_span_is(buf, h->name, "Content-Length"))
+        {
+            h->kind = HTTP_H_CONTENT_LENGTH;
+            if(h->value.len == 0 || h->value.len > 18)
+                return -1;
+            for(n = 0, i = 0; i < h->value.len; i++)
+            {
+                if(!IS_DIGIT(buf[h->value.off + i]))
+                    return -1;
+                n = n * 10 + (buf[h->value.off + i] - '0');
+            }
+            // Differing lengths would let two readers disagree on the body
+            if(m->content_length >= 0 && m->content_length != n)
+                return -1;
+            m->content_length = n;
+        }
+        break;
+    case 16:
+        if(http_span_is(buf, h->name, "Proxy-Connection"))
+        {
+            h->kind = HTTP_H_HOP;
+            if(m->conn == HTTP_CONN_DEFAULT)
+                m->conn = parse_conn(buf, h->value);
+        }
+        break;
+    case 17:
+        if(http_span_is(buf, h->name, "Transfer-Encoding"))
+        {
+            h->kind = HTTP_H_TRANSFER_ENCODING;
+            if(has_token(buf, h->value, "chunked"))
+                m->chunked = 1;
+        }
+        else if(http_span_is(buf, h->name, "If-Modified-Since"))
+            h->kind = HTTP_H_CONDITIONAL;
+        break;
+    }
+    return 0;
+}
+
+static int parse_conn(const char *buf, http_span_t v)
+{
+    if(has_token(buf, v, "close"))
+        return HTTP_CONN_CLOSE;
+    if(has_token(buf, v, "keep-alive"))
+        return HTTP_CONN_KEEP_ALIVE;
+    return HTTP_CONN_DEFAULT;
+}
+
+// Whether comma separated list in v has token, ignoring case
+static int has_token(const char *buf, http_span_t v, const char *token)
+{
+    const char *p = buf + v.off, *end = p + v.len, *e;
+    http_span_t t;
+
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for(e = p; e < end && *e != ','; e++)
+            ;
+        t.off = p - buf;
+        t.len = e - p;
+        while(t.len > 0 && (buf[t.off + t.len - 1] == ' ' || buf[t.off + t.len - 1] == '\t'))
+            t.len--;
+        if(http_span_is(buf, t, token))
+            return 1;
+        p = e;
+    }
+    return 0;
+}
+
+// Whether Cache-Control value v has directive name. Its argument, a number
+// that may be quoted, goes in *arg_p: 0 if missing or not a number, which
+// leaves the response stale
+static int directive(const char *buf, http_span_t v, const char *name, long *arg_p)
+{
+    const char *p = buf + v.off, *end = p + v.len, *e, *a;
+    int len = strlen(name);
+
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for(e = p; e < end && *e != ','; e++)
+            ;
+        for(a = p; a < e && *a != '=' && *a != ' ' && *a != '\t'; a++)
+            ;
+        if(a - p == len && !strncasecmp(p, name, len))
+        {
+            if(arg_p)
+            {
+                while(a < e && (*a == '=' || *a == '"' || *a == ' '))
+                    a++;
+                while(e > a && (e[-1] == '"' || e[-1] == ' ' || e[-1] == '\t'))
+                    e--;
+                if((*arg_p = parse_number(a, e)) < 0)
+                    *arg_p = 0;
+            }
+            return 1;
+        }
+        p = e;
+    }
+    return 0;
+}
+
+// Decimal number in [p, end), -1 if empty, not all digits or too long
+static long parse_number(const char *p, const char *end)
+{
+    long n = 0;
+
+    if(p == end || end - p > 18)
+        return -1;
+    for(; p < end; p++)
+    {
+        if(!IS_DIGIT(*p))
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+    return n;
+}
@@ -0,0 +1,124 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+#define HTTP_MAX_HEADERS 64     // more header lines than this is an error
+#define HTTP_DEFAULT_TTL 300    // seconds fresh if a response tells nothing
+#define HTTP_HEURISTIC_MAX 86400    // cap of lifetime guessed from Last-Modified
+
+// Result of http_parse
+#define HTTP_DONE 0             // whole head parsed, m->head_len bytes
+#define HTTP_AGAIN 1            // head incomplete, call again with more bytes
+#define HTTP_ERROR -1           // malformed, or too many headers
+
+// Kind of message, for http_init
+#define HTTP_REQUEST 0
+#define HTTP_RESPONSE 1
+
+// Headers the proxy looks at, everything else is HTTP_H_OTHER
+#define HTTP_H_OTHER 0
+#define HTTP_H_HOP 1            // Connection, Proxy-Connection, Keep-Alive
+#define HTTP_H_HOST 2
+#define HTTP_H_CONTENT_LENGTH 3
+#define HTTP_H_TRANSFER_ENCODING 4
+#define HTTP_H_CACHE_CONTROL 5
+#define HTTP_H_EXPIRES 6
+#define HTTP_H_DATE 7
+#define HTTP_H_AGE 8
+#define HTTP_H_ETAG 9
+#define HTTP_H_LAST_MODIFIED 10
+#define HTTP_H_CONDITIONAL 11   // If-None-Match, If-Modified-Since
+#define HTTP_H_RANGE 12
+#define HTTP_H_IF_RANGE 13
+#define HTTP_H_VARY 14
+#define HTTP_H_AUTHORIZATION 15
+
+// What Connection (or Proxy-Connection) asked for
+#define HTTP_CONN_DEFAULT 0
+#define HTTP_CONN_CLOSE 1
+#define HTTP_CONN_KEEP_ALIVE 2
+
+// Bytes [off, off + len) of the buffer being parsed. Offsets rather than
+// pointers, so that the buffer may move between calls
+typedef struct
+{
+    int off;
+    int len;
+} http_span_t;
+
+typedef struct
+{
+    int kind;               // HTTP_H_*
+    http_span_t line;       // whole line with its line end, to copy through
+    http_span_t name;
+    http_span_t value;      // without surrounding white space
+} http_header_t;
+
+// State and result of parsing one request or response head. Every span is
+// a view into the caller's buffer, nothing is copied
+typedef struct
+{
+    int type;               // HTTP_REQUEST or HTTP_RESPONSE
+    int state;              // where parsing resumes
+    int pos;                // start of first line not parsed yet
+    int scan;               // bytes from pos on already known to hold no LF
+    int head_len;           // length of head with its empty line, once done
+
+    // Request line, host and port come from url or else Host header
+    http_span_t method;
+    http_span_t url;
+    http_span_t host;
+    http_span_t path;       // may be empty or start with '?'
+    unsigned short port;
+
+    // Status line
+    int status;
+
+    int minor;              // HTTP/1.minor
+    long content_length;    // -1 if not given
+    int chunked;
+    int conn;               // HTTP_CONN_*
+    int has_host;
+
+    int nheaders;
+    http_header_t headers[HTTP_MAX_HEADERS];    // last, not cleared by http_init
+} http_msg_t;
+
+#define HTTP_PTR(buf, span) ((buf) + (span).off)
+
+void http_init(http_msg_t *m, int type);
+
+// Parse more of a message head. buf holds every byte of the head received so
+// far, from its first byte, len of them. Bytes already parsed are not looked
+// at again, so this is cheap to call after every read
+int http_parse(http_msg_t *m, const char *buf, int len);
+
+// Whether span of buf equals s, ignoring case
+int http_span_is(const char *buf, http_span_t span, const char *s);
+
+// First header of kind in m, NULL if none
+http_header_t *http_find(http_msg_t *m, int kind);
+
+// Whether response m in buf may be stored at all: by its status, it has no
+// Vary (copies are keyed on url alone) and, if the request was authorized,
+// Cache-Control lets a shared cache store it
+int http_cacheable(http_msg_t *m, const char *buf, int authorized);
+
+// Seconds response m in buf stays fresh from now on, from Cache-Control,
+// Expires or Last-Modified less Age, else HTTP_DEFAULT_TTL. 0 if it must be
+// revalidated before every use, -1 if it must not be stored. *strict_p is
+// set if it may never be served once stale: no-cache, must-revalidate,
+// proxy-revalidate or fresh for 0 seconds
+long http_freshness(http_msg_t *m, const char *buf, time_t now, int *strict_p);
+
+// Single byte range of Range value v for a body of size bytes, as the first
+// and last byte it covers. Returns 0, -1 if it covers none of the body, 1
+// if v is anything else (eg: several ranges), then the whole body is sent
+int http_range(const char *buf, http_span_t v, long size, long *first_p, long *last_p);
+
+// Time of an HTTP date in span of buf, eg: Sun, 06 Nov 1994 08:49:37 GMT.
+// Only this fixed format is understood, -1 for anything else
+time_t http_date(const char *buf, http_span_t v);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,152 @@
+/*
+ * Request counters and latency histograms.
+ *
+ * Each thread gets a slot of its own the first time it records anything and
+ * is the only writer of it, so recording is a relaxed load and store with
+ * no lock and no shared cache line. Slots are chained once, under a mutex,
+ * and never freed: threads of the proxy live as long as it does. Readers
+ * sum all slots on demand; a count may be a request behind, never torn.
+ */
+
+#include "metrics.h"
+
+typedef struct mslot
+{
+    atomic_long counters[METRIC_NCOUNTERS];
+    atomic_long hists[METRIC_NHISTS][METRIC_BUCKETS];
+    atomic_long sums[METRIC_NHISTS];    // us recorded, for the mean
+    struct mslot *next;
+} mslot_t;
+
+static const char *counter_names[METRIC_NCOUNTERS] =
+    {"requests", "hits", "coalesced", "misses", "errors", "connects", "reused"};
+static const char *hist_names[METRIC_NHISTS] =
+    {"total", "hit", "connect", "ttfb", "transfer"};
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mslot_t *slots;
+static __thread mslot_t *mine;
+
+static mslot_t *my_slot();
+static int bucket_of(long us);
+static long bucket_top(int b);
+static void add(atomic_long *x, long n);
+
+
+long Metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void Metrics_count(int counter, long n)
+{
+    add(&my_slot()->counters[counter], n);
+}
+
+long Metrics_since(int hist, long start)
+{
+    mslot_t *s = my_slot();
+    long now = Metrics_now(), us = now - start;
+
+    add(&s->hists[hist][bucket_of(us)], 1);
+    add(&s->sums[hist], us);
+    return now;
+}
+
+void Metrics_print(FILE *fp)
+{
+    static const double pcts[] = {0.5, 0.9, 0.99, 0.999};
+    long counters[METRIC_NCOUNTERS] = {0}, sums[METRIC_NHISTS] = {0};
+    long (*hists)[METRIC_BUCKETS] = Calloc(METRIC_NHISTS, sizeof(*hists));
+    long n, seen;
+    mslot_t *s;
+    int i, b, k;
+
+    pthread_mutex_lock(&slots_mutex);
+    for(s = slots; s; s = s->next)
+    {
+        for(i = 0; i < METRIC_NCOUNTERS; i++)
+            counters[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+        for(i = 0; i < METRIC_NHISTS; i++)
+        {
+            sums[i] += atomic_load_explicit(&s->sums[i], memory_order_relaxed);
+            for(b = 0; b < METRIC_BUCKETS; b++)
+                hists[i][b] += atomic_load_explicit(&s->hists[i][b], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&slots_mutex);
+
+    fprintf(fp, "requests:");
+    for(i = 0; i < METRIC_NCOUNTERS; i++)
+        fprintf(fp, "%s %s %ld", i ? "," : "", counter_names[i], counters[i]);
+    fprintf(fp, "\n");
+
+    // Percentiles are the top of the bucket they fall in
+    for(i = 0; i < METRIC_NHISTS; i++)
+    {
+        for(b = 0, n = 0; b < METRIC_BUCKETS; b++)
+            n += hists[i][b];
+        fprintf(fp, "latency %s: %ld, mean %ldus", hist_names[i], n, n ? sums[i] / n : 0);
+        for(k = 0, b = 0, seen = 0; n && k < (int)(sizeof(pcts) / sizeof(pcts[0])); k++)
+        {
+            while(seen + hists[i][b] < pcts[k] * n)
+                seen += hists[i][b++];
+            fprintf(fp, ", p%g %ldus", pcts[k] * 100, bucket_top(b));
+        }
+        for(b = METRIC_BUCKETS - 1; n && hists[i][b] == 0; b--)
+            ;
+        if(n)
+            fprintf(fp, ", max %ldus", bucket_top(b));
+        fprintf(fp, "\n");
+    }
+    Free(hists);
+}
+
+// Slot of calling thread, chained in on first use
+static mslot_t *my_slot()
+{
+    if(mine == NULL)
+    {
+        mine = Calloc(1, sizeof(mslot_t));
+        pthread_mutex_lock(&slots_mutex);
+        mine->next = slots;
+        slots = mine;
+        pthread_mutex_unlock(&slots_mutex);
+    }
+    return mine;
+}
+
+// Bucket of us: exponent picks the power of 2, the next METRIC_SUB_BITS
+// bits below the leading one pick the part of it
+static int bucket_of(long us)
+{
+    int e;
+
+    if(us < (1 << METRIC_SUB_BITS))
+        return us < 0 ? 0 : us;
+    e = 63 - __builtin_clzl(us);
+    if(e >= METRIC_MAX_BITS)
+        return METRIC_BUCKETS - 1;
+    return ((e - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS) +
+           ((us >> (e - METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1));
+}
+
+// Largest value of bucket b
+static long bucket_top(int b)
+{
+    int e = (b >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    long m = b & ((1 << METRIC_SUB_BITS) - 1);
+
+    if(b < (1 << METRIC_SUB_BITS))
+        return b;
+    return (((m + 1) + (1L << METRIC_SUB_BITS)) << (e - METRIC_SUB_BITS)) - 1;
+}
+
+// Only the owning thread writes x
+static void add(atomic_long *x, long n)
+{
+    atomic_store_explicit(x, atomic_load_explicit(x, memory_order_relaxed) + n, memory_order_relaxed);
+}
@@ -0,0 +1,48 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+#include "csapp.h"
+
+// Counters
+#define METRIC_REQUESTS 0       // requests read from browsers
+#define METRIC_HITS 1           // served from cache without asking server
+#define METRIC_COALESCED 2      // followed a fetch of another request
+#define METRIC_MISSES 3         // fetched from server
+#define METRIC_ERRORS 4         // server or browser failed in the middle
+#define METRIC_CONNECTS 5       // new connections to servers
+#define METRIC_REUSED 6         // requests sent on pooled connections
+#define METRIC_NCOUNTERS 7
+
+// Latency histograms
+#define METRIC_TOTAL 0          // request read to response sent
+#define METRIC_HIT 1            // same, for hits
+#define METRIC_CONNECT 2        // connecting to server, name lookup included
+#define METRIC_TTFB 3           // request sent to first response byte
+#define METRIC_TRANSFER 4       // first response byte to last
+#define METRIC_NHISTS 5
+
+// Histogram buckets are log-linear in us, as in HDR histograms: values
+// below 2^METRIC_SUB_BITS have a bucket each, every power of 2 above is
+// split in 2^METRIC_SUB_BITS, so a bucket is within 1/8 of its values.
+// Values from 2^METRIC_MAX_BITS us (about 18 minutes) on share the last
+#define METRIC_SUB_BITS 3
+#define METRIC_MAX_BITS 30
+#define METRIC_BUCKETS ((METRIC_MAX_BITS - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS)
+
+#define STATUS_PATH "/proxy-status"     // asked of proxy itself, gets all stats
+
+// Microseconds on the monotonic clock
+long Metrics_now();
+
+// Add n to counter of the calling thread. Every thread updates its own
+// slot without locks or atomic read-modify-write, only Metrics_print sums
+void Metrics_count(int counter, long n);
+
+// Record in histogram the time since start (from Metrics_now), return now
+long Metrics_since(int hist, long start);
+
+// Sum the slots of all threads and print counters and latency percentiles
+void Metrics_print(FILE *fp);
+
+#endif /* __METRICS_H__ */
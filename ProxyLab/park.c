@@ -0,0 +1,155 @@
+/*
+ * Idle browser connections between keep-alive requests.
+ *
+ * A worker thread that finished a response and finds nothing more to read
+ * parks the connection here instead of blocking on it. A single thread
+ * waits on all parked connections with epoll and queues each one that
+ * becomes readable back to the workers. Parked connections form a list in
+ * order of parking, so the ones idle longer than PARK_IDLE_TIMEOUT are
+ * always at its head.
+ */
+
+#include <sys/epoll.h>
+#include "park.h"
+
+typedef struct parked
+{
+    int fd;
+    time_t since;           // when it was parked
+    struct parked *prev;
+    struct parked *next;
+} parked_t;
+
+// Same as accept path of proxy.c turns browsers away with
+static const char *busy_str = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static int epfd;
+static sbuf_t *queue;
+static sem_t mutex;         // protects list and nparked
+static parked_t *head, *rear;
+static int nparked;
+
+static void *park_thread(void *vargp);
+static void unlink_parked(parked_t *p);
+
+
+void Park_init(sbuf_t *sp)
+{
+    pthread_t tid;
+
+    if((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    queue = sp;
+    head = rear = NULL;
+    nparked = 0;
+    Sem_init(&mutex, 0, 1);
+    Pthread_create(&tid, NULL, park_thread, NULL);
+}
+
+void Park_browser(int fd)
+{
+    struct epoll_event ev;
+    parked_t *p = Malloc(sizeof(parked_t));
+
+    p->fd = fd;
+    p->since = time(NULL);
+    p->next = NULL;
+
+    P(&mutex);
+    p->prev = rear;
+    if(rear)
+        rear->next = p;
+    else
+        head = p;
+    rear = p;
+    nparked++;
+
+    // One shot: once readable it is no longer ours to watch
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = p;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        unix_error("epoll_ctl error");
+        unlink_parked(p);
+        close(fd);
+        Free(p);
+    }
+    V(&mutex);
+}
+
+int Park_count()
+{
+    int n;
+
+    P(&mutex);
+    n = nparked;
+    V(&mutex);
+    return n;
+}
+
+static void *park_thread(void *vargp)
+{
+    struct epoll_event events[PARK_MAX_EVENTS];
+    parked_t *p;
+    time_t now;
+    int i, n;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        // Wake up at least every second to close expired connections
+        if((n = epoll_wait(epfd, events, PARK_MAX_EVENTS, 1000)) < 0)
+        {
+            if(errno != EINTR)
+                unix_error("epoll_wait error");
+            continue;
+        }
+
+        for(i = 0; i < n; i++)
+        {
+            p = events[i].data.ptr;
+            P(&mutex);
+            unlink_parked(p);
+            V(&mutex);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+
+            // A next request or a close, worker finds out which. Queue full:
+            // waiting for room would stall every other parked connection
+            if(events[i].events & EPOLLERR)
+                close(p->fd);
+            else if(sbuf_try_insert(queue, p->fd) == -1)
+            {
+                rio_writen(p->fd, (void *)busy_str, strlen(busy_str));
+                close(p->fd);
+            }
+            Free(p);
+        }
+
+        now = time(NULL);
+        P(&mutex);
+        while((p = head) != NULL && now - p->since >= PARK_IDLE_TIMEOUT)
+        {
+            unlink_parked(p);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            close(p->fd);
+            Free(p);
+        }
+        V(&mutex);
+    }
+    return NULL;
+}
+
+// Remove p from list, caller holds mutex
+static void unlink_parked(parked_t *p)
+{
+    if(p->prev)
+        p->prev->next = p->next;
+    else
+        head = p->next;
+    if(p->next)
+        p->next->prev = p->prev;
+    else
+        rear = p->prev;
+    nparked--;
+}
@@ -0,0 +1,20 @@
+#ifndef __PARK_H__
+#define __PARK_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+#define PARK_IDLE_TIMEOUT 30    // seconds a browser may stay idle between requests
+#define PARK_MAX_EVENTS 256
+
+// Start the thread watching parked browser connections, each one that
+// sends its next request is queued to sp for a worker
+void Park_init(sbuf_t *sp);
+
+// Give up a keep-alive browser connection with nothing to read yet
+void Park_browser(int fd);
+
+// Number of connections parked right now
+int Park_count();
+
+#endif /* __PARK_H__ */
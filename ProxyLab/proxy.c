@@ -3,19 +3,36 @@
  * Andrew id: bfeng
 */
 
-#include "csapp.h"
+#define _GNU_SOURCE     // splice, pipe2, strcasestr, memmem
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include "proxy.h"
 #include "cache.h"
+#include "event.h"
+#include "sbuf.h"
+#include "upstream.h"
+#include "park.h"
+#include "dns.h"
+#include "disk.h"
+#include "refresh.h"
+#include "metrics.h"
 
 //static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 //static const char *accept_str = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
 //static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
 //static const char *connection_str = "Connection: close\r\nProxy-Connection: close\r\n";
+static const char *partial_str = "HTTP/1.1 206 Partial Content\r\n";
+static const char *busy_str = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char *too_large_str = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char *bad_gateway_str = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 
-int browser_to_server(rio_t *browser_rio, int proxy_as_client_fd, char *uri);
-int server_to_browser(rio_t *proxy_as_client_rio, int browser_fd, char *url);
-int write_buf_to_cache_browser(int browser_fd, int *tsize_p, char **cache_p, char **cache_cur_p, char *buf, int length);
-void *thread(void *vargp);
-int parse_uri(char* uri, char* host, char* path, unsigned short *port_p);
+static long max_head = DEFAULT_MAX_HEAD;
+static __thread char *big_head[2];      // per HTTP_REQUEST or HTTP_RESPONSE, for
+static __thread long big_cap[2];        // heads larger than the rio buffer
+
+static sbuf_t sbuf;     // connected descriptors waiting for a worker
+static int nthreads;    // worker threads in pool, 0 in event mode
 
 
 int main(int argc, char **argv)
@@ -23,298 +40,1177 @@ int main(int argc, char **argv)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD,SIG_IGN);
 
-    int *connfdp;
+    int connfd, one = 1;
     struct sockaddr_in clientaddr;
     pthread_t tid;
+    int opt, i, nloops = -1, per_core = 0;
+    int blocking = DEFAULT_BLOCKING_FACTOR, qsize = DEFAULT_QUEUE_SIZE;
+    char *disk_dir = NULL;
+    cache_conf_t conf = {
+        .policy = "clock",
+        .tinylfu = 0,
+        .capacity = MAX_CACHE_SIZE,
+        .max_object = MAX_OBJECT_SIZE,
+        .shards = CACHE_SHARDS,
+        .grace = CACHE_GRACE,
+        .local = 0,
+    };
+    sigset_t mask;
+
+    // -e <n>: serve with n epoll event loops instead of the thread pool,
+    //         n == 0 means one loop per core
+    // -b <n>: blocking factor, pool has cores * (1 + n) worker threads
+    // -q <n>: at most n accepted connections wait for a worker
+    // -P <p>: cache eviction policy, clock or slru
+    // -A:     TinyLFU admission, cache only objects more popular than victims
+    // -d <d>: keep cache in segment files under directory d as well
+    // -C <n>: cache capacity in bytes, k, m or g suffix allowed
+    // -O <n>: largest object cached, suffix as for -C
+    // -S <n>: cache shards, each gets an equal share of capacity
+    // -G <n>: hot objects are served up to n seconds stale while refreshed
+    //         in background, 0 turns background refresh off
+    // -R:     event loops each accept on a SO_REUSEPORT socket of their own,
+    //         run pinned to a core and have a cache shard each; one loop
+    //         per core unless -e says otherwise
+    // -H <n>: largest request or response head, suffix as for -C
+    while ((opt = getopt(argc, argv, "e:b:q:P:Ad:C:O:S:G:RH:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            nloops = atoi(optarg);
+            if (nloops <= 0)
+                nloops = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'b':
+            blocking = atoi(optarg);
+            break;
+        case 'q':
+            qsize = atoi(optarg);
+            break;
+        case 'P':
+            conf.policy = optarg;
+            break;
+        case 'A':
+            conf.tinylfu = 1;
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'C':
+            conf.capacity = parse_size(optarg);
+            break;
+        case 'O':
+            conf.max_object = parse_size(optarg);
+            break;
+        case 'S':
+            conf.shards = atoi(optarg);
+            break;
+        case 'G':
+            conf.grace = atol(optarg);
+            break;
+        case 'R':
+            per_core = 1;
+            break;
+        case 'H':
+            max_head = parse_size(optarg);
+            break;
+        default:
+            nloops = -2;
+            break;
+        }
+    }
 
-    if (argc != 2)
+    // Per core mode stores into the shard of the loop, looks in the others
+    // before fetching
+    if (per_core && nloops != -2)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        if (nloops < 0)
+            nloops = sysconf(_SC_NPROCESSORS_ONLN);
+        conf.shards = nloops;
+        conf.local = 1;
+    }
+
+    if (nloops == -2 || argc - optind != 1 || blocking < 0 || qsize <= 0 || conf.grace < 0 ||
+        max_head < MAXLINE || max_head > INT_MAX || Cache_init(&conf) == -1)
+    {
+        fprintf(stderr, "usage: %s [-e nloops] [-b blocking] [-q queue] [-P clock|slru] [-A] "
+                "[-d dir] [-C capacity] [-O max_object] [-S shards] [-G grace] [-R] "
+                "[-H max_head] <port>\n"
+                "capacity / shards must be at least max_object\n", argv[0]);
         exit(1);
     }
 
-    Cache_init();
+    // Cached objects hold a memfd each, allow as many descriptors as we may
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // SIGUSR1 is only taken by stats thread, every later thread inherits mask
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    Upstream_init();
+    Dns_init();
+    Pthread_create(&tid, NULL, stats_thread, NULL);
+    if (conf.grace > 0)
+        Refresh_init();
+
+    if (disk_dir && Disk_init(disk_dir) == -1)
+    {
+        fprintf(stderr, "%s: cannot use cache directory %s: %s\n", argv[0], disk_dir, strerror(errno));
+        exit(1);
+    }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     socklen_t clientlen = sizeof(clientaddr);
+    if (per_core)
+        Event_run_per_core(port, nloops);
     int listenfd = Open_listenfd(port);
+
+    if (nloops > 0)
+        Event_run(listenfd, nloops);
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN) * (1 + blocking);
+    sbuf_init(&sbuf, qsize);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, thread, NULL);
+    Park_init(&sbuf);
+
     while (1)
     {
-        connfdp = (int *)malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        if ((connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen)) < 0)
+            continue;
+
+        // A response goes out in several writes, head then body: without
+        // this the last one waits for browser's delayed ACK
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // Queue full: turn browser away now rather than pile up
+        if (sbuf_try_insert(&sbuf, connfd) == -1)
+        {
+            rio_writen(connfd, (void *)busy_str, strlen(busy_str));
+            Close(connfd);
+        }
     }
     return 0;
 }
 
+// Byte count with optional k, m or g suffix, -1 if malformed
+long parse_size(char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
 
-void* thread(void *vargp)
+    switch (*end)
+    {
+    case 'g': case 'G':
+        n <<= 10;
+        // fall through
+    case 'm': case 'M':
+        n <<= 10;
+        // fall through
+    case 'k': case 'K':
+        n <<= 10;
+        end++;
+    }
+    return (end == s || *end || n < 0) ? -1 : n;
+}
+
+// Print statistics to stderr whenever SIGUSR1 arrives
+void *stats_thread(void *vargp)
 {
-    rio_t browser_rio, proxy_as_client_rio;
-    char buf[MAXLINE],
-         uri[MAXLINE], host[MAXLINE];
-    unsigned short port;
+    sigset_t mask;
+    int sig;
 
+    (void)vargp;
     Pthread_detach(pthread_self());
-    int browser_fd = *(int *)vargp;
-    Free(vargp);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
 
-    Rio_readinitb(&browser_rio, browser_fd);
+    while (1)
+    {
+        if (sigwait(&mask, &sig) == 0)
+            print_stats(stderr);
+    }
+    return NULL;
+}
+
+// Statistics of pool, cache, refresh, disk and requests, a line each
+void print_stats(FILE *fp)
+{
+    sbuf_stats_t st;
+    cache_stats_t cs;
+    disk_stats_t ds;
+    refresh_stats_t rs;
+
+    if (nthreads > 0)
+    {
+        sbuf_stats(&sbuf, &st);
+        fprintf(fp, "pool: %d threads, queue %d/%d (max %d), accepted %ld, rejected %ld, "
+                "wait avg %ldus max %ldus, parked %d\n", nthreads, st.depth, st.size, st.max_depth,
+                st.inserted, st.rejected, st.wait_avg, st.wait_max, Park_count());
+    }
+
+    Cache_stats(&cs);
+    fprintf(fp, "cache: %s%s, %ld objects %ld/%ld bytes (%ld per shard), index %ld bytes "
+            "(%ld per object) + %ld fixed, hit ratio %.3f, byte hit ratio %.3f, disk hits %ld "
+            "(%ld bytes), revalidated %ld (%ld bytes), admitted %ld, rejected %ld, evicted %ld\n",
+            cs.policy, cs.tinylfu ? "+tinylfu" : "", cs.objects,
+            cs.bytes, cs.capacity, cs.shard_capacity, cs.index_bytes,
+            cs.objects ? cs.index_bytes / cs.objects : 0, cs.table_bytes,
+            cs.hits + cs.disk_hits ?
+                (double)(cs.hits + cs.disk_hits) / (cs.hits + cs.disk_hits + cs.misses) : 0.0,
+            cs.hit_bytes + cs.disk_hit_bytes ? (double)(cs.hit_bytes + cs.disk_hit_bytes) /
+                (cs.hit_bytes + cs.disk_hit_bytes + cs.miss_bytes) : 0.0,
+            cs.disk_hits, cs.disk_hit_bytes, cs.revalidated, cs.revalidated_bytes, cs.admitted, cs.rejected, cs.evicted);
+
+    Refresh_stats(&rs);
+    if (rs.queued + rs.dropped > 0)
+        fprintf(fp, "refresh: queued %ld, dropped %ld, unchanged %ld, replaced %ld, not stored %ld, "
+                "failed %ld\n", rs.queued, rs.dropped, rs.unchanged, rs.replaced, rs.unstored, rs.failed);
+
+    if (Disk_enabled())
+    {
+        Disk_stats(&ds);
+        fprintf(fp, "disk: %d segments, %ld objects %ld bytes, index %ld bytes (%ld per object) "
+                "+ %ld fixed, hits %ld (%ld bytes), writes %ld (%ld bytes), dropped %ld, oversized %ld\n",
+                ds.segments, ds.objects, ds.bytes, ds.index_bytes,
+                ds.objects ? ds.index_bytes / ds.objects : 0, ds.table_bytes,
+                ds.hits, ds.hit_bytes, ds.writes, ds.write_bytes, ds.dropped, ds.oversized);
+    }
 
-    // Read client request line, eg: GET www.cmu.edu/index.html HTTP/1.1
-    Rio_readlineb(&browser_rio, buf, MAXLINE);
+    Metrics_print(fp);
+}
 
-    char method[MAXLINE], url[MAXLINE], version[MAXLINE];
-    // Parse client request line to get method, url, version
-    sscanf(buf, "%s %s %s", method, url, version);
+// Worker of thread pool: serve browser connections from sbuf, one at a time
+void *thread(void *vargp)
+{
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1)
+        serve_browser(sbuf_remove(&sbuf));
+    return NULL;
+}
 
-    parse_uri(url, host, uri, &port);
+// Serve requests of a browser connection in order, as long as browser keeps
+// it alive. An idle connection is parked between requests, not this worker
+void serve_browser(int browser_fd)
+{
+    rio_t browser_rio;
 
+    Rio_readinitb(&browser_rio, browser_fd);
+    while(serve_request(&browser_rio, browser_fd))
+    {
+        // Go on with pipelined request if already buffered
+        if(browser_rio.rio_cnt == 0)
+        {
+            Park_browser(browser_fd);
+            return;
+        }
+    }
+    Close(browser_fd);
+}
 
+// Serve one request of browser, return 1 if its connection may carry another
+int serve_request(rio_t *browser_rio, int browser_fd)
+{
+    rio_t proxy_as_client_rio;
+    char url[MAXLINE], host[MAXLINE], *head;
+    unsigned short port;
+    http_msg_t msg;
+    long start, first;
+    int keep, rc;
+
+    // Parse request header where it lies in rio buffer,
+    // eg: GET http://www.cmu.edu/index.html HTTP/1.1
+    http_init(&msg, HTTP_REQUEST);
+    if((rc = read_head(browser_rio, &msg, &head)) <= 0)
+    {
+        if(rc == HEAD_TOO_LARGE)
+            send_status(browser_fd, 431);
+        return 0;
+    }
+    start = Metrics_now();
 
     // Ignore non-get methods
-    if (strcasecmp(method, "GET"))
+    if(!http_span_is(head, msg.method, "GET"))
     {
-        Close(browser_fd);
         fprintf(stderr, "Only GET method is supported\n");
-        pthread_exit(NULL);
+        return 0;
     }
 
-    // Check whether in cache already
-    int cstat = Get_cache(url, browser_fd);
+    // Only HTTP/1.1 browsers get a persistent connection, responses are not
+    // rewritten to announce one to HTTP/1.0 browsers
+    keep = msg.minor >= 1 && msg.conn != HTTP_CONN_CLOSE;
 
-    // If already cached and forwarded to client, simply quit
-    if(cstat == CACHED)
+    // Request for the proxy itself rather than a server
+    if(is_status_request(head, &msg, browser_fd))
     {
-        Close(browser_fd);
-        fprintf(stderr, "Found in cache\n");
-        pthread_exit(NULL);
+        int len;
+        char *resp = status_response(&len);
+
+        keep = keep && rio_writen(browser_fd, resp, len) == len;
+        Free(resp);
+        return keep;
     }
+    Metrics_count(METRIC_REQUESTS, 1);
 
-    // Proxy as client to connect to server
-    int proxy_as_client_fd = Open_clientfd(host, port);
-    Rio_readinitb(&proxy_as_client_rio, proxy_as_client_fd);
+    // Only url and host are copied out, they outlive the rio buffer. Cache
+    // key is the absolute url even if browser sent the path alone
+    if(msg.host.len == 0 || msg.host.len >= MAXLINE || msg.url.len + msg.host.len + 16 >= MAXLINE)
+    {
+        fprintf(stderr, "Bad request\n");
+        return 0;
+    }
+    sprintf(host, "%.*s", msg.host.len, HTTP_PTR(head, msg.host));
+    port = msg.port;
+    if(msg.path.off == msg.url.off)
+        snprintf(url, MAXLINE, "http://%.*s:%d%.*s", msg.host.len, HTTP_PTR(head, msg.host), port, msg.path.len, HTTP_PTR(head, msg.path));
+    else
+        sprintf(url, "%.*s", msg.url.len, HTTP_PTR(head, msg.url));
+
+    // Check whether in cache and fresh, stored responses all carry a length.
+    // A stale copy with validators is revalidated: server is asked whether
+    // it changed instead of for all of it. Byte range of a cached copy is
+    // cut from it. Range requests for anything else go to server as they
+    // are, their 206 is not stored
+    cdata *stale;
+    if(http_find(&msg, HTTP_H_RANGE))
+        rc = send_range(url, head, &msg, browser_fd, &stale);
+    else
+        rc = Get_cache(url, browser_fd, &stale);
+    if(rc != UNCACHED)
+    {
+        Metrics_count(METRIC_HITS, 1);
+        Metrics_since(METRIC_HIT, start);
+        Metrics_since(METRIC_TOTAL, start);
+        if(stale)
+        {
+            // Due to expire or just expired, refreshed before anyone waits
+            Refresh_put(stale);
+            Release_cache(stale);
+        }
+        return keep && rc == CACHED;
+    }
+
+    // Build request for server once, so it can be sent again if a pooled
+    // connection turns out to be closed by server
+    char *req;
+    int req_len = browser_to_server(head, &msg, host, port, &req, stale);
 
-    // If not yet cached, proxy get request from client
-    if(browser_to_server(&browser_rio, proxy_as_client_fd, uri) == -1)
+    // Fetch of url already under way: follow it rather than ask server too
+    int leader;
+    cflight *f = Join_flight(url, &leader);
+    if(!leader)
     {
-        Close(browser_fd);
-        Close(proxy_as_client_fd);
-        fprintf(stderr, "browser_to_server error\n");
-        pthread_exit(NULL);
+        int frc = Follow_flight(f, browser_fd);
+        if(frc != UNCACHED)
+        {
+            Metrics_count(METRIC_COALESCED, 1);
+            Metrics_since(METRIC_TOTAL, start);
+            if(stale)
+                Release_cache(stale);
+            Free(req);
+            return keep && frc == CACHED;
+        }
+        f = NULL;   // leader gave up before anything was sent, on our own
+
+        // Leader may have revalidated the stale copy we have too
+        if(stale && Cache_fresh(stale))
+        {
+            Write_cache(stale, browser_fd);
+            Metrics_count(METRIC_COALESCED, 1);
+            Metrics_since(METRIC_TOTAL, start);
+            Release_cache(stale);
+            Free(req);
+            return keep;
+        }
     }
 
-    // Proxy forward response to client browser
-    server_to_browser(&proxy_as_client_rio, browser_fd, url);
-    Close(browser_fd);
-    Close(proxy_as_client_fd);
-    pthread_exit(NULL);
+    int proxy_as_client_fd, reused, stored;
+    Metrics_count(METRIC_MISSES, 1);
+    rc = RESP_ERROR;
+    do
+    {
+        // Proxy as client to connect to server, keep-alive one if possible
+        if((proxy_as_client_fd = Upstream_get(host, port, &reused)) < 0)
+            break;
+        Rio_readinitb(&proxy_as_client_rio, proxy_as_client_fd);
+
+        // Proxy forward response to client browser. First byte of it is
+        // waited for here to time server apart from relaying
+        if(rio_writen(proxy_as_client_fd, req, req_len) != req_len)
+            rc = RESP_NONE;
+        else
+        {
+            first = Metrics_now();
+            if(rio_fillb(&proxy_as_client_rio) > 0)
+                first = Metrics_since(METRIC_TTFB, first);
+            rc = server_to_browser(&proxy_as_client_rio, browser_fd, url, f, stale,
+                                   http_find(&msg, HTTP_H_AUTHORIZATION) != NULL, &stored);
+            if(rc >= RESP_CLOSE)
+                Metrics_since(METRIC_TRANSFER, first);
+        }
+
+        if(rc == RESP_KEEP)
+            Upstream_put(host, port, proxy_as_client_fd);
+        else
+            Upstream_close(host, port, proxy_as_client_fd);
+    } while(rc == RESP_NONE && reused);
+
+    if(f)
+        End_flight(f);
+    if(stale)
+        Release_cache(stale);
+    Free(req);
+    if(rc == RESP_ERROR || rc == RESP_NONE)
+        Metrics_count(METRIC_ERRORS, 1);
+    Metrics_since(METRIC_TOTAL, start);
+
+    // Browser can only tell where the response ended if it had a length
+    return keep && (rc == RESP_KEEP || rc == RESP_CLOSE);
 }
 
+// Whether request m in head is for STATUS_PATH of the proxy itself: a path
+// without server, from a browser on this host
+int is_status_request(char *head, http_msg_t *m, int browser_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    return m->path.off == m->url.off && http_span_is(head, m->path, STATUS_PATH) &&
+           getpeername(browser_fd, (SA *)&addr, &len) == 0 && addr.sin_family == AF_INET &&
+           (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
 
-int browser_to_server(rio_t *browser_rio, int proxy_as_client_fd, char *uri)
+// Response to a status request, print_stats as plain text. Malloced,
+// length in *len_p
+char *status_response(int *len_p)
 {
-    char buf[MAXLINE];
-    int n = 0;
+    char *body = NULL, *resp;
+    size_t n = 0;
+    FILE *fp;
+
+    if((fp = open_memstream(&body, &n)) != NULL)
+    {
+        print_stats(fp);
+        fclose(fp);
+    }
+    resp = Malloc(n + 128);
+    *len_p = sprintf(resp, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                     "Cache-Control: no-store\r\n\r\n", n);
+    memcpy(resp + *len_p, body, n);
+    *len_p += n;
+    free(body);
+    return resp;
+}
+
+// Answer Range request m in head from the fresh cached copy of url: 206
+// with the bytes asked for, 416 if there are none, the whole copy if the
+// range is not one we take or If-Range does not match. Head comes from the
+// stored one, the body slice straight from the cache buffers. Returns
+// UNCACHED if url has no fresh copy, CACHED once sent, -1 if browser failed.
+// Copy is looked up once: *stale_p is set as by Get_cache
+int send_range(char *url, char *head, http_msg_t *m, int browser_fd, cdata **stale_p)
+{
+    struct iovec iov[HTTP_MAX_HEADERS + 3];
+    char *stored_head, tail[128];
+    http_header_t *h;
+    http_msg_t stored;
+    long body, first, last;
+    int state, i, from, to, end, n = 0, whole, rc;
+    cdata *p;
+
+    *stale_p = NULL;
+    if((p = Lookup_cache(url)) == NULL)
+        return UNCACHED;
+    if((state = Cache_check(p)) == CACHE_STALE)
+    {
+        if(p->etag || p->last_modified)
+            *stale_p = p;
+        else
+            Release_cache(p);
+        return UNCACHED;
+    }
 
-    sprintf(buf, "GET %s HTTP/1.0\r\n", uri);
+    // Stored head lies in the first chunk, smaller than any. A range is
+    // only cut from a 200 the validator in If-Range (if any) still names
+    stored_head = p->cache;
+    http_init(&stored, HTTP_RESPONSE);
+    whole = http_parse(&stored, stored_head, p->lens[0]) != HTTP_DONE || stored.status != 200;
+    if(!whole && (h = http_find(m, HTTP_H_IF_RANGE)) != NULL)
+        whole = !(p->etag && strncmp(p->etag, "W/", 2) && (size_t)h->value.len == strlen(p->etag) &&
+                  !memcmp(HTTP_PTR(head, h->value), p->etag, h->value.len)) &&
+                !(p->last_modified && http_span_is(head, h->value, p->last_modified));
+
+    body = stored.head_len;
+    if(whole || (rc = http_range(head, http_find(m, HTTP_H_RANGE)->value, p->size - body,
+                                 &first, &last)) == 1)
+    {
+        rc = Write_cache(p, browser_fd);
+    }
+    else if(rc == -1)
+    {
+        n = sprintf(tail, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+                    "Content-Length: 0\r\n\r\n", p->size - body);
+        rc = (rio_writen(browser_fd, tail, n) == n) ? 0 : -1;
+    }
+    else
+    {
+        // Stored header lines but Content-Length, then range and length
+        iov[n].iov_base = (void *)partial_str;
+        iov[n++].iov_len = strlen(partial_str);
+        from = end = 0;
+        if(stored.nheaders > 0)
+        {
+            from = stored.headers[0].line.off;
+            end = stored.headers[stored.nheaders - 1].line.off + stored.headers[stored.nheaders - 1].line.len;
+        }
+        for(i = 0; i <= stored.nheaders; i++)
+        {
+            if(i < stored.nheaders && stored.headers[i].kind != HTTP_H_CONTENT_LENGTH)
+                continue;
+            to = (i < stored.nheaders) ? stored.headers[i].line.off : end;
+            if(to > from)
+            {
+                iov[n].iov_base = stored_head + from;
+                iov[n++].iov_len = to - from;
+            }
+            if(i < stored.nheaders)
+                from = to + stored.headers[i].line.len;
+        }
+        iov[n].iov_base = tail;
+        iov[n++].iov_len = sprintf(tail, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n\r\n",
+                                   first, last, p->size - body, last - first + 1);
+
+        rc = writev_all(browser_fd, iov, n);
+        if(rc == 0)
+            rc = Write_cache_range(p, browser_fd, body + first, body + last + 1);
+    }
 
-    // Send http request line to server
-    Rio_writen(proxy_as_client_fd, buf, strlen(buf));
+    if(state == CACHE_DUE)
+        *stale_p = p;
+    else
+        Release_cache(p);
+    return rc == 0 ? CACHED : -1;
+}
+
+// writev all of iov[0..n) to fd, 0 on success. iov is used up
+int writev_all(int fd, struct iovec *iov, int n)
+{
+    ssize_t k;
 
-    // Read http request header from client browser
-    while((n = rio_readlineb(browser_rio, buf, MAXLINE)))
+    while(n > 0)
     {
-        if(n == -1)
+        if((k = writev(fd, iov, n)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
             return -1;
+        }
 
-        if(strcmp(buf, "\r\n")==0)
-            break;
+        // Skip what went out, resume in the middle of a piece
+        while(n > 0 && (size_t)k >= iov->iov_len)
+        {
+            k -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + k;
+            iov->iov_len -= k;
+        }
+    }
+    return 0;
+}
+
+// Parse message head at the front of rp's buffer, reading more as needed,
+// and take it out of the buffer. *head_p is where it starts, spans of m are
+// valid until the next read from rp. A head that fills the rio buffer moves
+// to a buffer of the thread, one per kind of message, grown up to
+// max_head; then it is valid until the next head of its kind is read.
+// Return 1 once parsed, 0 if rp was at EOF, -1 if head is malformed or cut
+// short, HEAD_TOO_LARGE beyond max_head
+int read_head(rio_t *rp, http_msg_t *m, char **head_p)
+{
+    ssize_t n;
+    long len, cap;
+    int rc;
 
-        // Forward http request header to server
+    while((rc = http_parse(m, rp->rio_bufptr, rp->rio_cnt > 0 ? rp->rio_cnt : 0)) == HTTP_AGAIN)
+    {
+        if(rp->rio_cnt >= RIO_BUFSIZE)
+            break;
+        if((n = rio_fillb(rp)) <= 0)
+            return (n == 0 && rp->rio_cnt <= 0) ? 0 : -1;
+    }
+    if(rc == HTTP_ERROR)
+        return -1;
+    if(rc == HTTP_DONE)
+    {
+        *head_p = rp->rio_bufptr;
+        rp->rio_bufptr += m->head_len;
+        rp->rio_cnt -= m->head_len;
+        return 1;
+    }
 
-        if(Rio_writen(proxy_as_client_fd, buf, strlen(buf)) == -1)
+    // Move all the rio buffer holds to the big one and refill it, until
+    // the head is whole
+    for(len = 0; rc == HTTP_AGAIN; len += n)
+    {
+        if(len > 0 && (n = rio_fillb(rp)) <= 0)
             return -1;
+        n = rp->rio_cnt;
+        if(len + n > big_cap[m->type])
+        {
+            for(cap = big_cap[m->type] ? big_cap[m->type] : 2 * RIO_BUFSIZE; cap < len + n; cap *= 2)
+                ;
+            big_head[m->type] = Realloc(big_head[m->type], cap);
+            big_cap[m->type] = cap;
+        }
+        memcpy(big_head[m->type] + len, rp->rio_bufptr, n);
+        rp->rio_bufptr += n;
+        rp->rio_cnt = 0;
+        rc = http_parse(m, big_head[m->type], len + n);
+        if(rc == HTTP_AGAIN ? len + n >= max_head : rc == HTTP_DONE && m->head_len > max_head)
+            return HEAD_TOO_LARGE;
     }
+    if(rc == HTTP_ERROR)
+        return -1;
 
-    strncpy(buf, "\r\n", 4);
-    Rio_writen(proxy_as_client_fd, buf, strlen(buf));
+    // Bytes after the head came with the last fill, they are still in rio
+    // buffer right behind its pointer
+    rp->rio_cnt = len - m->head_len;
+    rp->rio_bufptr -= rp->rio_cnt;
+    *head_p = big_head[m->type];
+    return 1;
+}
 
-    return 0;
+// Largest head read_head takes
+long max_head_size()
+{
+    return max_head;
 }
 
-// Read response header and body from server, forward to client browser and save a copy
-// in cache
-int server_to_browser(rio_t *proxy_as_client_rio, int browser_fd, char *url)
+// Empty response of status, 431 or 502, to browser that gets no other.
+// The connection must be closed after
+void send_status(int fd, int status)
 {
-    int tsize = 0;  // total size of cache
-    int csize = 0;  // size of a response block
-    int n = 0;
-    char* cache = malloc(MAX_OBJECT_SIZE);
-    char* cache_cur = cache;
+    const char *resp = (status == 431) ? too_large_str : bad_gateway_str;
 
-    char buf[MAXLINE];
+    rio_writen(fd, (void *)resp, strlen(resp));
+}
 
-    // Read response line from server, eg: HTTP/1.1 200 OK
-    rio_readlineb(proxy_as_client_rio, buf, MAXLINE);
+// Build the request for server in *req_p (malloced) out of parsed browser
+// request head: HTTP/1.1 request line, browser headers except the
+// connection management ones, a Host header and our keep-alive. Request
+// to revalidate stale, if not NULL, asks only whether it changed.
+// Return length of request
+int browser_to_server(char *head, http_msg_t *m, char *host, unsigned short port, char **req_p,
+                      cdata *stale)
+{
+    int i, len, cap = m->head_len + m->path.len + strlen(host) + 2 * CACHE_VALIDATOR_MAX + 128;
+    char *req = Malloc(cap);
+    http_header_t *h;
 
-    // 1. Proxy write server response header line
-    if(write_buf_to_cache_browser(browser_fd, &tsize, &cache, &cache_cur, buf, strlen(buf)) == -1)
-        return -1;
+    len = sprintf(req, "GET %s%.*s HTTP/1.1\r\n", (m->path.len > 0 && head[m->path.off] == '/') ? "" : "/",
+                  m->path.len, HTTP_PTR(head, m->path));
 
-    // Read response header from server
-    while((n = rio_readlineb(proxy_as_client_rio, buf, MAXLINE)))
+    // Hop-by-hop headers are about browser's connection, not ours
+    for(i = 0; i < m->nheaders; i++)
     {
-        if (!strncasecmp(buf, "Content-Length: ", 16))
-            csize = atoi(buf + 16);     // record content length
+        h = &m->headers[i];
+        if(h->kind == HTTP_H_HOP || (stale && h->kind == HTTP_H_CONDITIONAL))
+            continue;
+        memcpy(req + len, HTTP_PTR(head, h->line), h->line.len);
+        len += h->line.len;
+    }
 
-        // 2. Proxy write server response header
-        write_buf_to_cache_browser(browser_fd, &tsize, &cache, &cache_cur, buf, strlen(buf));
+    // Browser's own conditions are left out, it gets the whole response
+    // whether our copy changed or not
+    if(stale && stale->etag)
+        len += sprintf(req + len, "If-None-Match: %s\r\n", stale->etag);
+    if(stale && stale->last_modified)
+        len += sprintf(req + len, "If-Modified-Since: %s\r\n", stale->last_modified);
 
-        if(!strcmp(buf, "\r\n"))
-            break;
+    if(!m->has_host)
+        len += (port == 80) ? sprintf(req + len, "Host: %s\r\n", host)
+                            : sprintf(req + len, "Host: %s:%d\r\n", host, port);
+    len += sprintf(req + len, "Connection: keep-alive\r\n\r\n");
+
+    *req_p = req;
+    return len;
+}
+
+// Read response header and body from server, forward to client browser and save a copy
+// in cache. Bytes that are sure to be cached are published to followers of
+// flight f as they arrive, if f is not NULL. If server answers that stale
+// (not NULL) has not changed, stale is refreshed and sent instead. With
+// browser_fd < 0 the response only goes to cache: nothing is written to a
+// browser, and a response that would not be stored is left unread with
+// RESP_ERROR returned, so that the connection gets closed. Response to an
+// authorized request is only stored if it allows so. *stored_p tells what
+// became of the response in cache, STORE_*. Returns
+//   RESP_KEEP   response is complete and server keeps connection open
+//   RESP_CLOSE  response is complete, connection can not be reused
+//   RESP_EOF    response ended by server closing, so must browser's
+//   RESP_ERROR  server or browser failed in the middle
+//   RESP_NONE   server closed connection without a response
+int server_to_browser(rio_t *proxy_as_client_rio, int browser_fd, char *url, cflight *f,
+                      cdata *stale, int authorized, int *stored_p)
+{
+    long csize = -1;    // content length, -1 if not given
+    long life;
+    cfresh fr;
+    int n = 0, status = 0, chunked = 0, nobody, eof = 0, keep, rc, store = 1, strict;
+    cchain cache;       // copy for cache, dropped once too big
+
+    char buf[MAXLINE], *head;
+    http_msg_t msg;
+
+    // Parse response header from server where it lies in rio buffer,
+    // eg: HTTP/1.1 200 OK
+    *stored_p = STORE_FAILED;
+    http_init(&msg, HTTP_RESPONSE);
+    if((rc = read_head(proxy_as_client_rio, &msg, &head)) <= 0)
+    {
+        if(rc == HEAD_TOO_LARGE && browser_fd >= 0)
+            send_status(browser_fd, 502);
+        return rc == 0 ? RESP_NONE : RESP_ERROR;
+    }
+    status = msg.status;
+    csize = msg.content_length;
+    chunked = msg.chunked;
+
+    // HTTP/1.0 server only keeps alive if it says so
+    if(msg.minor >= 1)
+        keep = msg.conn != HTTP_CONN_CLOSE;
+    else
+        keep = msg.conn == HTTP_CONN_KEEP_ALIVE;
+
+    // Our copy is still good, 304 has no body. Followers find it fresh once
+    // let go
+    if(stale && status == 304)
+    {
+        life = revalidated_freshness(stale, &msg, head, &strict);
+        Cache_refresh(stale, life > 0 ? life : 0, strict);
+        *stored_p = STORE_REVALIDATED;
+        Flight_publish(f, NULL, 0);
+        if(browser_fd >= 0)
+            Write_cache(stale, browser_fd);
+        return keep ? RESP_KEEP : RESP_CLOSE;
+    }
+
+    // Responses that must not be stored are relayed all the same
+    Chain_init(&cache, Cache_max_object());
+    if(cache_freshness(head, &msg, &fr, authorized) == -1)
+    {
+        Chain_free(&cache);
+        Flight_publish(f, NULL, 0);
+        if(browser_fd < 0)
+        {
+            *stored_p = STORE_NONE;
+            return RESP_ERROR;
+        }
+    }
+
+    // 1. Proxy write status line and header, except hop-by-hop lines that
+    // are not for browser. Copy in cache of a chunked body is stored
+    // de-chunked, its framing headers are left out
+    nobody = status / 100 == 1 || status == 204 || status == 304;
+    if(chunked)
+    {
+        write_head(head, &msg, 1 << HTTP_H_HOP, browser_fd, NULL, NULL, 0);
+        write_head(head, &msg, 1 << HTTP_H_HOP | 1 << HTTP_H_TRANSFER_ENCODING |
+                   1 << HTTP_H_CONTENT_LENGTH, -1, &cache, NULL, 0);
+    }
+    else
+    {
+        // Body bytes read along with the head go out with it, straight
+        // from the rio buffer
+        n = 0;
+        if(!nobody && proxy_as_client_rio->rio_cnt > 0)
+        {
+            n = proxy_as_client_rio->rio_cnt;
+            if(csize >= 0 && n > csize)
+                n = csize;
+        }
+        write_head(head, &msg, 1 << HTTP_H_HOP, browser_fd, &cache, proxy_as_client_rio->rio_bufptr, n);
+        proxy_as_client_rio->rio_bufptr += n;
+        proxy_as_client_rio->rio_cnt -= n;
+        if(csize > 0)
+            csize -= n;
     }
 
     // ===============================================================
     // Continue only if response body exists!
 
+    // Too big for cache. Followers already waiting for a response they may
+    // share get it through the flight all the same, rather than fetch it
+    // again once the head is in
+    if(!nobody && !chunked && csize >= 0 && cache.bufs &&
+       cache.size + csize > Cache_max_object())
+    {
+        store = 0;
+        if(Flight_followers(f) > 0 && cache.size + csize <= FLIGHT_MAX_RELAY)
+            cache.limit = FLIGHT_MAX_RELAY;
+        else
+            Chain_free(&cache);
+    }
+
     // Read response body and forward to client
-    if(csize == 0)
+    if(nobody)
+        ;   // never has a body
+    else if(chunked)
     {
-        while((n = rio_readnb(proxy_as_client_rio, buf, MAXLINE)))
+        // Browser gets chunks as they are, cache gets the data with a
+        // Content-Length. Length is only known at the end, so followers
+        // wait for the whole response
+        if(relay_chunked(proxy_as_client_rio, browser_fd, &cache, f) == -1)
         {
-            // 3. Proxy write response body back to browser
-            write_buf_to_cache_browser(browser_fd, &tsize, &cache, &cache_cur, buf, n);
+            Chain_free(&cache);
+            return RESP_ERROR;
         }
+        if(cache.bufs)
+            add_content_length(&cache);
     }
-    else
+    else if(csize < 0)
     {
-        if((tsize += csize) > MAX_OBJECT_SIZE)
-            if(cache)
+        // Body ends when server closes
+        keep = 0;
+        eof = 1;
+
+        // Copy while body may still fit in cache
+        while(cache.bufs && (n = rio_readnb(proxy_as_client_rio, buf, MAXLINE)) > 0)
+        {
+            // 3. Proxy write response body back to browser
+            write_buf_to_cache_browser(browser_fd, &cache, buf, n);
+        }
+
+        // Too big for cache, splice the rest until server closes
+        if(cache.bufs == NULL)
+        {
+            Flight_publish(f, NULL, 0);
+            if(browser_fd < 0)
             {
-                Free(cache);
-                cache = NULL;
+                *stored_p = STORE_NONE;
+                return RESP_ERROR;
             }
+            splice_to_browser(proxy_as_client_rio, browser_fd, -1);
+        }
+        else
+            add_content_length(&cache);
+    }
+    else if(cache.bufs == NULL)
+    {
+        // Never cached nor shared, no need to see the body at all
+        Flight_publish(f, NULL, 0);
+        if(browser_fd < 0)
+        {
+            *stored_p = STORE_NONE;
+            return RESP_ERROR;
+        }
+        if(splice_to_browser(proxy_as_client_rio, browser_fd, csize) == -1)
+            return RESP_ERROR;
+    }
+    else
+    {
+        // Whole response fits in cache (or is relayed), followers may start
+        // with header. Large ones grow by a chunk at a time as body streams through
+        Flight_publish(f, &cache, 0);
 
         // Read MAXLINE size each time
-        while(csize >= MAXLINE)
+        while(csize > 0)
         {
-            n = rio_readnb(proxy_as_client_rio, buf, MAXLINE);
+            if((n = rio_readnb(proxy_as_client_rio, buf, csize < MAXLINE ? csize : MAXLINE)) <= 0)
+            {
+                // Truncated by server, do not cache
+                Chain_free(&cache);
+                return RESP_ERROR;
+            }
 
             // 4. Proxy write response body back to browser
-            write_buf_to_cache_browser(browser_fd, NULL, &cache, &cache_cur, buf, n);
+            write_buf_to_cache_browser(browser_fd, &cache, buf, n);
+            Flight_publish(f, &cache, 0);
 
-            csize -= MAXLINE;
-        }
-
-        // Read remaining part: csize<MAXLINE
-        if(csize > 0)
-        {
-            n = rio_readnb(proxy_as_client_rio, buf, csize);
-
-            // 5. Proxy write remaining response body back to browser
-            write_buf_to_cache_browser(browser_fd, NULL, &cache, &cache_cur, buf, n);
+            csize -= n;
         }
     }
 
-    // Insert <url,cache> pair to linked list
-//    if(cache)
-        if(Insert_cache(url, cache, tsize) == -1)
-            return -1;
+    // Insert <url,cache> pair to cache, which adopts the buffer
+    rc = eof ? RESP_EOF : keep ? RESP_KEEP : RESP_CLOSE;
+    *stored_p = STORE_NONE;
+    if(cache.bufs)
+    {
+        Flight_publish(f, &cache, 1);
+        if(store && Insert_cache(url, &cache, &fr) == 0)
+            *stored_p = STORE_NEW;
+        else
+            Chain_free(&cache);
+    }
 
-    return 0;
+    return rc;
 }
 
-
-int parse_uri(char* uri, char* host, char* path, unsigned short *port_p)
+// Seconds stale stays fresh after a 304 response m with head, and in
+// *strict_p whether it is strict. Its Cache-Control or Expires, if any, win
+// over those stored with stale
+long revalidated_freshness(cdata *stale, http_msg_t *m, char *head, int *strict_p)
 {
+    http_msg_t stored;
 
-    char* uri_begin = uri+7;
-    char port_str[1024];
-    char* port_begin;
-    char* port_end;
-    *port_p = 80;
-
-    // Find if there is : in uri
-    port_begin = strstr(uri_begin, ":");
-    // printf("port_begin:%s\n", port_begin);
+    if(http_find(m, HTTP_H_CACHE_CONTROL) || http_find(m, HTTP_H_EXPIRES))
+        return http_freshness(m, head, time(NULL), strict_p);
 
-    if(port_begin != NULL){
-        port_end = strstr(port_begin, "/");
-        // printf("port_end:%s\n", port_end);
-
-        int port_begin_index = port_begin - uri_begin;
-        int port_end_index = port_end - uri_begin;
+    // Stored head lies in the first chunk, smaller than any
+    http_init(&stored, HTTP_RESPONSE);
+    *strict_p = 1;
+    if(http_parse(&stored, stale->cache, stale->lens[0]) != HTTP_DONE)
+        return 0;
+    return http_freshness(&stored, stale->cache, time(NULL), strict_p);
+}
 
-        // printf("uri_begin:%s\n", uri_begin);
-        strncpy(host, uri_begin, port_begin_index);
-        host[port_begin_index] = '\0';
-        // printf("host:%s\n", host);
+// Freshness of response m with head for cache in *fr, from now on.
+// Return -1 if response must not be stored, authorized if its request
+// carried credentials
+int cache_freshness(char *head, http_msg_t *m, cfresh *fr, int authorized)
+{
+    time_t now = time(NULL);
+    http_header_t *h;
+    long life;
 
-        // printf("%d\n", port_begin_index);
-        // printf("%d\n", port_end_index);
+    if(!http_cacheable(m, head, authorized) || (life = http_freshness(m, head, now, &fr->strict)) < 0)
+        return -1;
+    fr->expires = now + life;
+    fr->lifetime = life;
+
+    // Validators too long to keep only mean a full fetch once stale
+    fr->etag[0] = fr->last_modified[0] = '\0';
+    if((h = http_find(m, HTTP_H_ETAG)) != NULL && h->value.len < CACHE_VALIDATOR_MAX)
+        sprintf(fr->etag, "%.*s", h->value.len, HTTP_PTR(head, h->value));
+    if((h = http_find(m, HTTP_H_LAST_MODIFIED)) != NULL && h->value.len < CACHE_VALIDATOR_MAX)
+        sprintf(fr->last_modified, "%.*s", h->value.len, HTTP_PTR(head, h->value));
+    return 0;
+}
 
-        strncpy(port_str, uri_begin+port_begin_index+1, port_end_index-port_begin_index-1);
-        *port_p = atoi(port_str);
+// Stored copy of a response that ended with the connection gets the
+// Content-Length header it lacked, so that hits can be served on a
+// persistent connection. Drops the copy if that makes it too big
+void add_content_length(cchain *c)
+{
+    char line[64], *head, *end, *p;
+    int n;
 
-        strcpy(path, uri_begin+port_end_index);
-        // printf("path:%s\n", path);
-        // printf("port_str:%s\n", port_str);
-        // printf("port:%d\n", atoi(port_str));
+    // Head is all in the first buffer, it is smaller than any
+    head = c->bufs[0];
+    if((end = memmem(head, c->lens[0], "\r\n\r\n", 4)) != NULL)
+    {
+        // Nothing to do if server sent one anyway
+        p = head;
+        while((p = memmem(p, end + 2 - p, "\r\n", 2)) != NULL && (p += 2) < end + 2)
+            if(!strncasecmp(p, "Content-Length:", 15))
+                return;
     }
-    else{
-        port_end = strstr(uri_begin, "/");
-        strncpy(host, uri_begin, port_end - uri_begin);
-        host[port_end - uri_begin] = '\0';
-        // printf("host:%s\n", host);
-
-        // printf("port_end:%s\n", port_end);
 
-        strcpy(path, port_end);
-        // printf("path:%s\n", path);
+    if(end == NULL)
+    {
+        Chain_free(c);
+        return;
     }
 
-    return 0;
+    // Goes right before the empty line ending the header
+    n = sprintf(line, "Content-Length: %ld\r\n", c->size - (end + 4 - head));
+    Chain_insert(c, end + 2 - head, line, n);
 }
 
-// Write buf to client browser and cache
-int write_buf_to_cache_browser(int browser_fd, int *tsize_p, char **cache_p, char **cache_cur_p, char *buf, int length)
+// Write head of m, then len bytes of body, to browser_fd (if >= 0) and
+// chain c (if not NULL), leaving out header lines of kinds in skip, a mask
+// of 1 << HTTP_H_*. Browser gets it all with one writev, chain in one append
+int write_head(char *head, http_msg_t *m, int skip, int browser_fd, cchain *c, char *body, int len)
 {
-    // Proxy send response data to browser
-    int n = 0;
+    struct iovec iov[HTTP_MAX_HEADERS + 2];
+    int i, from, to, n = 0;
 
-    if(browser_fd > 0)
-        n = Rio_writen(browser_fd, buf, length);
+    for(from = 0, i = 0; i <= m->nheaders; i++)
+    {
+        if(i < m->nheaders && !(skip & 1 << m->headers[i].kind))
+            continue;
+        to = (i < m->nheaders) ? m->headers[i].line.off : m->head_len;
+        if(to > from)
+        {
+            iov[n].iov_base = head + from;
+            iov[n++].iov_len = to - from;
+        }
+        if(i < m->nheaders)
+            from = to + m->headers[i].line.len;
+    }
+    if(len > 0)
+    {
+        iov[n].iov_base = body;
+        iov[n++].iov_len = len;
+    }
 
-    if(n <= 0){
+    // Store to cache, even if browser went away. writev_all uses up iov
+    if(c)
+        Chain_appendv(c, iov, n);
+    if(browser_fd > 0 && writev_all(browser_fd, iov, n) == -1)
         return -1;
-    }
+    return 0;
+}
+
+// Relay a chunked body verbatim, up to and including its trailer, and append
+// the chunk data alone to c. Followers of f are let go as soon as c gets
+// too big, without a browser (browser_fd < 0) the relay stops there.
+// Return 0 once the last chunk went through, -1 if it stopped early, server
+// or browser failed or a chunk size line is malformed
+int relay_chunked(rio_t *proxy_as_client_rio, int browser_fd, cchain *c, cflight *f)
+{
+    char buf[MAXLINE];
+    long size, data;
+    int n, k;
 
-    // Store to cache
-    if(*cache_p)
+    while(1)
     {
-        if (tsize_p != NULL)
+        // Chunk size line, eg: 1f4;ext=1
+        if((n = rio_readlineb(proxy_as_client_rio, buf, MAXLINE)) <= 0)
+            return -1;
+        if(write_buf_to_cache_browser(browser_fd, NULL, buf, n) == -1)
+            return -1;
+        if((size = chunk_size(buf)) < 0)
+            return -1;
+        if(size == 0)
+            break;
+
+        // Chunk data and its CRLF
+        for(data = size, size += 2; size > 0; size -= n)
         {
-            if(*tsize_p + n > MAX_OBJECT_SIZE)   // Too big, ignore
+            if((n = rio_readnb(proxy_as_client_rio, buf, size < MAXLINE ? size : MAXLINE)) <= 0)
+                return -1;
+            if(write_buf_to_cache_browser(browser_fd, NULL, buf, n) == -1)
+                return -1;
+
+            if(c->bufs && data > 0)
             {
-                if(*cache_p)
+                k = (n < data) ? n : data;
+                data -= k;
+                if(Chain_append(c, buf, k) == -1)
                 {
-                    Free(*cache_p);
-                    *cache_p = NULL;
+                    Flight_publish(f, NULL, 0);
+                    if(browser_fd < 0)
+                        return -1;      // nobody wants the rest
                 }
             }
-            else
-            {
-                memcpy(*cache_cur_p, buf, n);
-                *cache_cur_p += n;      // Update current index in cache_p
-                *tsize_p += n;   // Inrease cache current size
-            }
         }
-        else
+    }
+
+    // Trailer headers up to the empty line
+    while((n = rio_readlineb(proxy_as_client_rio, buf, MAXLINE)) > 0)
+    {
+        if(write_buf_to_cache_browser(browser_fd, NULL, buf, n) == -1)
+            return -1;
+        if(!strcmp(buf, "\r\n"))
+            return 0;
+    }
+    return -1;
+}
+
+// Size in a chunk size line: hex digits, then optional whitespace and a
+// chunk extension after ';', or the line end. -1 if line is anything else
+// or the size does not fit a long
+long chunk_size(char *line)
+{
+    long size = 0;
+    char *p;
+    int d;
+
+    for(p = line; isxdigit((unsigned char)*p); p++)
+    {
+        d = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+        if(size > (LONG_MAX - d) / 16)
+            return -1;
+        size = size * 16 + d;
+    }
+    if(p == line)
+        return -1;
+    while(*p == ' ' || *p == '\t')
+        p++;
+    return (*p == ';' || *p == '\r' || *p == '\n') ? size : -1;
+}
+
+// Relay n bytes of response body (n < 0: until server closes) from server to
+// browser through a pipe with splice, so they never get copied to user space.
+// Bytes rio already buffered go first
+int splice_to_browser(rio_t *proxy_as_client_rio, int browser_fd, long n)
+{
+    int pipefd[2], err = 0;
+    ssize_t in, out;
+    size_t want;
+    char buf[MAXLINE];
+
+    // Drain what rio read ahead
+    if(proxy_as_client_rio->rio_cnt > 0)
+    {
+        in = proxy_as_client_rio->rio_cnt;
+        if(n >= 0 && in > n)
+            in = n;
+        rio_readnb(proxy_as_client_rio, buf, in);
+        if(write_buf_to_cache_browser(browser_fd, NULL, buf, in) == -1)
+            return -1;
+        if(n > 0)
+            n -= in;
+    }
+
+    if(pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+
+    while(n != 0 && !err)
+    {
+        want = (n < 0 || n > SPLICE_CHUNK) ? SPLICE_CHUNK : n;
+        in = splice(proxy_as_client_rio->rio_fd, NULL, pipefd[1], NULL, want,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in < 0 && errno == EINTR)
+            continue;
+        if(in <= 0)
+            break;      // EOF or error
+
+        if(n > 0)
+            n -= in;
+        while(in > 0)
         {
-            memcpy(*cache_cur_p, buf, n);
-            *cache_cur_p += n;
+            out = splice(pipefd[0], NULL, browser_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out < 0 && errno == EINTR)
+                continue;
+            if(out <= 0)
+            {
+                err = 1;
+                break;
+            }
+            in -= out;
         }
     }
-    return 0;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return (err || n > 0) ? -1 : 0;
+}
+
+// Write buf to client browser and cache, either may be left out
+int write_buf_to_cache_browser(int browser_fd, cchain *c, char *buf, int length)
+{
+    // Proxy send response data to browser
+    int rc = 0;
+
+    if(browser_fd > 0 && Rio_writen(browser_fd, buf, length) != length)
+        rc = -1;
+
+    // Store to cache, even if browser went away. Too big, ignore
+    if(c)
+        Chain_append(c, buf, length);
+    return rc;
 }
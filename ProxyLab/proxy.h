@@ -0,0 +1,56 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+#define SPLICE_CHUNK 65536    // bytes moved per splice
+#define DEFAULT_BLOCKING_FACTOR 8   // worker threads per core beyond the first
+#define DEFAULT_QUEUE_SIZE 1024     // connections waiting for a worker
+#define DEFAULT_MAX_HEAD (64 << 10) // bytes of a request or response head
+
+// Outcome of relaying one response, see server_to_browser
+#define RESP_EOF 2
+#define RESP_KEEP 1
+#define RESP_CLOSE 0
+#define RESP_ERROR -1
+#define RESP_NONE -2
+
+// read_head found a head larger than max_head_size
+#define HEAD_TOO_LARGE -2
+
+// What a response did to the cache, see server_to_browser
+#define STORE_FAILED -1     // no whole response
+#define STORE_NONE 0        // not stored
+#define STORE_NEW 1         // stored as the new copy
+#define STORE_REVALIDATED 2 // 304, stale copy is good again
+
+int read_head(rio_t *rp, http_msg_t *m, char **head_p);
+long max_head_size();
+void send_status(int fd, int status);
+int is_status_request(char *head, http_msg_t *m, int browser_fd);
+char *status_response(int *len_p);
+int send_range(char *url, char *head, http_msg_t *m, int browser_fd, cdata **stale_p);
+int writev_all(int fd, struct iovec *iov, int n);
+int browser_to_server(char *head, http_msg_t *m, char *host, unsigned short port, char **req_p,
+                      cdata *stale);
+int server_to_browser(rio_t *proxy_as_client_rio, int browser_fd, char *url, cflight *f,
+                      cdata *stale, int authorized, int *stored_p);
+int cache_freshness(char *head, http_msg_t *m, cfresh *fr, int authorized);
+long revalidated_freshness(cdata *stale, http_msg_t *m, char *head, int *strict_p);
+int write_head(char *head, http_msg_t *m, int skip, int browser_fd, cchain *c, char *body, int len);
+int relay_chunked(rio_t *proxy_as_client_rio, int browser_fd, cchain *c, cflight *f);
+long chunk_size(char *line);
+void add_content_length(cchain *c);
+int splice_to_browser(rio_t *proxy_as_client_rio, int browser_fd, long n);
+int write_buf_to_cache_browser(int browser_fd, cchain *c, char *buf, int length);
+void *thread(void *vargp);
+long parse_size(char *s);
+void *stats_thread(void *vargp);
+void print_stats(FILE *fp);
+void serve_browser(int browser_fd);
+int serve_request(rio_t *browser_rio, int browser_fd);
+
+#endif /* __PROXY_H__ */
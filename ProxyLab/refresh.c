@@ -0,0 +1,153 @@
+/*
+ * Background refresh of hot cache objects.
+ *
+ * A hit on an object that is hot and about to expire, or expired less than
+ * the grace period ago, is still served from cache but the object is queued
+ * here. Refresher threads revalidate it with its server just as a request
+ * would, so that the first request after expiry need not wait for the
+ * server. Only one refresh of an object is under way at a time: the node is
+ * claimed by Cache_check and let go here.
+ */
+
+#include "proxy.h"
+#include "refresh.h"
+#include "upstream.h"
+
+typedef struct rqueue
+{
+    cdata *node;
+    struct rqueue *next;
+} rqueue_t;
+
+static pthread_mutex_t qmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+static rqueue_t *qhead, *qrear;
+static int qlen;
+static refresh_stats_t stats;       // guarded by qmutex
+
+static void *refresh_thread(void *vargp);
+static int refresh(cdata *p, int *stored_p);
+
+
+void Refresh_init()
+{
+    pthread_t tid;
+    int i;
+
+    for(i = 0; i < REFRESH_THREADS; i++)
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
+}
+
+void Refresh_put(cdata *acache)
+{
+    rqueue_t *q;
+
+    pthread_mutex_lock(&qmutex);
+    if(qlen == REFRESH_QUEUE_MAX)
+    {
+        stats.dropped++;
+        pthread_mutex_unlock(&qmutex);
+        atomic_store(&acache->refreshing, 0);
+        return;
+    }
+
+    // Caller's pin keeps node alive until we hold our own
+    atomic_fetch_add(&acache->refcnt, 1);
+    q = Malloc(sizeof(rqueue_t));
+    q->node = acache;
+    q->next = NULL;
+    if(qrear)
+        qrear->next = q;
+    else
+        qhead = q;
+    qrear = q;
+    qlen++;
+    stats.queued++;
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qmutex);
+}
+
+void Refresh_stats(refresh_stats_t *st)
+{
+    pthread_mutex_lock(&qmutex);
+    *st = stats;
+    pthread_mutex_unlock(&qmutex);
+}
+
+static void *refresh_thread(void *vargp)
+{
+    rqueue_t *q;
+    int stored;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        pthread_mutex_lock(&qmutex);
+        while(qhead == NULL)
+            pthread_cond_wait(&qcond, &qmutex);
+        q = qhead;
+        if((qhead = q->next) == NULL)
+            qrear = NULL;
+        qlen--;
+        pthread_mutex_unlock(&qmutex);
+
+        // A 304 moves expiry of node, a new copy replaces node in cache
+        refresh(q->node, &stored);
+
+        pthread_mutex_lock(&qmutex);
+        if(stored == STORE_REVALIDATED)
+            stats.unchanged++;
+        else if(stored == STORE_NEW)
+            stats.replaced++;
+        else if(stored == STORE_NONE)
+            stats.unstored++;
+        else
+            stats.failed++;
+        pthread_mutex_unlock(&qmutex);
+
+        atomic_store(&q->node->refreshing, 0);
+        Release_cache(q->node);
+        Free(q);
+    }
+    return NULL;
+}
+
+// Ask server of p's url for it again, conditionally if p has validators.
+// Returns and sets *stored_p like server_to_browser
+static int refresh(cdata *p, int *stored_p)
+{
+    char head[MAXLINE], host[MAXLINE], *req;
+    http_msg_t msg;
+    rio_t rio;
+    int fd, reused, req_len, rc = RESP_ERROR;
+
+    *stored_p = STORE_FAILED;
+
+    // Request as a browser would send it for the url
+    snprintf(head, MAXLINE, "GET %s HTTP/1.1\r\n\r\n", p->url);
+    http_init(&msg, HTTP_REQUEST);
+    if(http_parse(&msg, head, strlen(head)) != HTTP_DONE)
+        return RESP_ERROR;
+    sprintf(host, "%.*s", msg.host.len, HTTP_PTR(head, msg.host));
+    req_len = browser_to_server(head, &msg, host, msg.port, &req, p);
+
+    do
+    {
+        if((fd = Upstream_get(host, msg.port, &reused)) < 0)
+            break;
+        Rio_readinitb(&rio, fd);
+        if(rio_writen(fd, req, req_len) != req_len)
+            rc = RESP_NONE;
+        else
+            rc = server_to_browser(&rio, -1, p->url, NULL, p, 0, stored_p);
+
+        if(rc == RESP_KEEP)
+            Upstream_put(host, msg.port, fd);
+        else
+            Upstream_close(host, msg.port, fd);
+    } while(rc == RESP_NONE && reused);
+
+    Free(req);
+    return rc;
+}
@@ -0,0 +1,26 @@
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "cache.h"
+
+#define REFRESH_THREADS 2       // objects refreshed at the same time
+#define REFRESH_QUEUE_MAX 256   // objects waiting, more are not refreshed
+
+// Background refresh statistics
+typedef struct
+{
+    long queued, dropped;       // objects handed to Refresh_put
+    long unchanged, replaced;   // server said 304, or answered in full
+    long unstored;              // answered with what cache does not keep
+    long failed;
+} refresh_stats_t;
+
+void Refresh_init();
+
+// Queue node that Cache_check found due to be revalidated with its server.
+// Takes a reference of its own, caller still releases its pin
+void Refresh_put(cdata *acache);
+
+void Refresh_stats(refresh_stats_t *st);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,100 @@
+#include "sbuf.h"
+
+static long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Put item at rear of buffer, caller owns a slot
+static void put(sbuf_t *sp, int item)
+{
+    int depth;
+
+    P(&sp->mutex);
+    sp->rear++;
+    sp->buf[sp->rear % sp->n] = item;
+    sp->stamp[sp->rear % sp->n] = now_us();
+    sp->inserted++;
+    if((depth = sp->rear - sp->front) > sp->max_depth)
+        sp->max_depth = depth;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+// Create an empty, bounded, shared FIFO buffer with n slots
+void sbuf_init(sbuf_t *sp, int n)
+{
+    memset(sp, 0, sizeof(sbuf_t));
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(long));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+// Clean up buffer sp
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+// Insert item onto the rear of shared buffer sp, wait for a free slot
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);
+    put(sp, item);
+}
+
+// Insert item unless buffer is full, return -1 in that case
+int sbuf_try_insert(sbuf_t *sp, int item)
+{
+    if(sem_trywait(&sp->slots) < 0)
+    {
+        P(&sp->mutex);
+        sp->rejected++;
+        V(&sp->mutex);
+        return -1;
+    }
+    put(sp, item);
+    return 0;
+}
+
+// Remove and return the first item from buffer sp, wait for one if empty
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    long wait;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    sp->front++;
+    item = sp->buf[sp->front % sp->n];
+    wait = now_us() - sp->stamp[sp->front % sp->n];
+    sp->removed++;
+    sp->wait_total += wait;
+    if(wait > sp->wait_max)
+        sp->wait_max = wait;
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st)
+{
+    P(&sp->mutex);
+    st->depth = sp->rear - sp->front;
+    st->size = sp->n;
+    st->max_depth = sp->max_depth;
+    st->inserted = sp->inserted;
+    st->rejected = sp->rejected;
+    st->removed = sp->removed;
+    st->wait_avg = sp->removed ? sp->wait_total / sp->removed : 0;
+    st->wait_max = sp->wait_max;
+    V(&sp->mutex);
+}
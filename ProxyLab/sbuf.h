@@ -0,0 +1,47 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+// Bounded FIFO of connected descriptors shared by the accept loop
+// (producer) and the worker threads (consumers)
+typedef struct
+{
+    int *buf;           // buffer array
+    long *stamp;        // time (us) each item was inserted
+    int n;              // maximum number of slots
+    int front;          // buf[(front+1)%n] is first item
+    int rear;           // buf[rear%n] is last item
+    sem_t mutex;        // protects accesses to buf and stats
+    sem_t slots;        // counts available slots
+    sem_t items;        // counts available items
+
+    long inserted;      // items taken in
+    long rejected;      // items refused because buffer was full
+    long removed;       // items handed to consumers
+    long wait_total;    // us items spent in buffer, summed
+    long wait_max;      // longest us an item spent in buffer
+    int max_depth;      // most items ever waiting at once
+} sbuf_t;
+
+// Snapshot of sbuf counters
+typedef struct
+{
+    int depth;
+    int size;           // slots
+    int max_depth;
+    long inserted;
+    long rejected;
+    long removed;
+    long wait_avg;      // us
+    long wait_max;      // us
+} sbuf_stats_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_try_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st);
+
+#endif /* __SBUF_H__ */
@@ -0,0 +1,253 @@
+/*
+ * Pool of persistent (HTTP/1.1 keep-alive) connections to servers.
+ *
+ * Idle connections are kept per origin <host, port> as a stack, the most
+ * recently used on top since it is the most likely to still be open.
+ * Connections idle longer than UPSTREAM_IDLE_TIMEOUT are closed when met
+ * or by a sweep every UPSTREAM_SWEEP seconds, which also frees origins left
+ * without connections. A connection is checked for a close by the server
+ * before reuse.
+ * Connections open to an origin, busy or idle, are at most
+ * UPSTREAM_MAX_CONNS; more requests wait for one of them. Event mode does
+ * not use the pool and is not limited.
+ */
+
+#include "upstream.h"
+#include "metrics.h"
+
+typedef struct origin
+{
+    char *host;
+    int port;
+    int nidle;
+    int nconns;                         // open, idle ones included
+    int nwaiting;                       // threads waiting in Upstream_get
+    int fd[UPSTREAM_MAX_IDLE];          // fd[0] is the oldest
+    time_t since[UPSTREAM_MAX_IDLE];    // when fd[i] became idle
+    struct origin *next;
+} origin_t;
+
+static origin_t *buckets[UPSTREAM_BUCKETS];
+static pthread_mutex_t locks[UPSTREAM_LOCKS];
+static pthread_cond_t freed[UPSTREAM_LOCKS];    // a connection went idle or closed
+
+static unsigned int hash_origin(char *host, int port);
+static origin_t *find_origin(unsigned int b, char *host, int port, int create);
+static void drop_expired(unsigned int b, origin_t *o, time_t now);
+static void closed(unsigned int b, origin_t *o, int n);
+static void *sweep_thread(void *vargp);
+static int is_alive(int fd);
+
+
+void Upstream_init()
+{
+    pthread_t tid;
+    int i;
+
+    memset(buckets, 0, sizeof(buckets));
+    for(i = 0; i < UPSTREAM_LOCKS; i++)
+    {
+        pthread_mutex_init(&locks[i], NULL);
+        pthread_cond_init(&freed[i], NULL);
+    }
+    Pthread_create(&tid, NULL, sweep_thread, NULL);
+}
+
+int Upstream_get(char *host, int port, int *reused_p)
+{
+    unsigned int b = hash_origin(host, port);
+    pthread_mutex_t *lock = &locks[b % UPSTREAM_LOCKS];
+    origin_t *o;
+    long start;
+    int fd;
+
+    pthread_mutex_lock(lock);
+    o = find_origin(b, host, port, 1);
+    while(1)
+    {
+        drop_expired(b, o, time(NULL));
+        if(o->nidle > 0)
+        {
+            fd = o->fd[--o->nidle];
+            pthread_mutex_unlock(lock);
+            if(is_alive(fd))
+            {
+                Metrics_count(METRIC_REUSED, 1);
+                *reused_p = 1;
+                return fd;
+            }
+            close(fd);
+            pthread_mutex_lock(lock);
+            closed(b, o, 1);
+            continue;
+        }
+        if(o->nconns < UPSTREAM_MAX_CONNS)
+            break;
+        o->nwaiting++;      // keeps sweep from freeing o meanwhile
+        pthread_cond_wait(&freed[b % UPSTREAM_LOCKS], lock);
+        o->nwaiting--;
+    }
+    o->nconns++;    // ours from now on, before the connect
+    pthread_mutex_unlock(lock);
+
+    *reused_p = 0;
+    start = Metrics_now();
+    if((fd = Open_clientfd(host, port)) >= 0)
+    {
+        Metrics_count(METRIC_CONNECTS, 1);
+        Metrics_since(METRIC_CONNECT, start);
+    }
+    else
+    {
+        pthread_mutex_lock(lock);
+        closed(b, o, 1);
+        pthread_mutex_unlock(lock);
+    }
+    return fd;
+}
+
+void Upstream_put(char *host, int port, int fd)
+{
+    unsigned int b = hash_origin(host, port);
+    origin_t *o;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&locks[b % UPSTREAM_LOCKS]);
+    o = find_origin(b, host, port, 1);
+    drop_expired(b, o, now);
+
+    // Pool of origin is full: the oldest connection makes room
+    if(o->nidle == UPSTREAM_MAX_IDLE)
+    {
+        close(o->fd[0]);
+        memmove(o->fd, o->fd + 1, (UPSTREAM_MAX_IDLE - 1) * sizeof(int));
+        memmove(o->since, o->since + 1, (UPSTREAM_MAX_IDLE - 1) * sizeof(time_t));
+        o->nidle--;
+        closed(b, o, 1);
+    }
+    o->fd[o->nidle] = fd;
+    o->since[o->nidle] = now;
+    o->nidle++;
+    pthread_cond_broadcast(&freed[b % UPSTREAM_LOCKS]);
+    pthread_mutex_unlock(&locks[b % UPSTREAM_LOCKS]);
+}
+
+void Upstream_close(char *host, int port, int fd)
+{
+    unsigned int b = hash_origin(host, port);
+    origin_t *o;
+
+    close(fd);
+    pthread_mutex_lock(&locks[b % UPSTREAM_LOCKS]);
+    if((o = find_origin(b, host, port, 0)) != NULL)
+        closed(b, o, 1);
+    pthread_mutex_unlock(&locks[b % UPSTREAM_LOCKS]);
+}
+
+static unsigned int hash_origin(char *host, int port)
+{
+    unsigned int h = 2166136261u;
+
+    while(*host)
+    {
+        h ^= (unsigned char)tolower(*host++);
+        h *= 16777619u;
+    }
+    h ^= port;
+    h *= 16777619u;
+    return h & (UPSTREAM_BUCKETS - 1);
+}
+
+// Find origin in bucket b, optionally create it. Bucket lock held
+static origin_t *find_origin(unsigned int b, char *host, int port, int create)
+{
+    origin_t *o;
+
+    for(o = buckets[b]; o; o = o->next)
+        if(o->port == port && strcasecmp(o->host, host) == 0)
+            return o;
+
+    if(!create)
+        return NULL;
+
+    o = Calloc(1, sizeof(origin_t));
+    o->host = Malloc(strlen(host) + 1);
+    strcpy(o->host, host);
+    o->port = port;
+    o->next = buckets[b];
+    buckets[b] = o;
+    return o;
+}
+
+// Close connections of o that sat idle too long. Bucket lock held
+static void drop_expired(unsigned int b, origin_t *o, time_t now)
+{
+    int i, n = 0;
+
+    while(n < o->nidle && now - o->since[n] > UPSTREAM_IDLE_TIMEOUT)
+        close(o->fd[n++]);
+    if(n == 0)
+        return;
+    closed(b, o, n);
+
+    for(i = n; i < o->nidle; i++)
+    {
+        o->fd[i - n] = o->fd[i];
+        o->since[i - n] = o->since[i];
+    }
+    o->nidle -= n;
+}
+
+// n connections of o in bucket b were closed, waiters may open new ones.
+// Bucket lock held
+static void closed(unsigned int b, origin_t *o, int n)
+{
+    o->nconns -= n;
+    pthread_cond_broadcast(&freed[b % UPSTREAM_LOCKS]);
+}
+
+// Close expired connections of all origins and free the origins nobody
+// uses any more, else idle sockets to origins never asked again stay open
+static void *sweep_thread(void *vargp)
+{
+    origin_t **pp, *o;
+    time_t now;
+    unsigned int b;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        Sleep(UPSTREAM_SWEEP);
+        now = time(NULL);
+        for(b = 0; b < UPSTREAM_BUCKETS; b++)
+        {
+            pthread_mutex_lock(&locks[b % UPSTREAM_LOCKS]);
+            pp = &buckets[b];
+            while((o = *pp) != NULL)
+            {
+                drop_expired(b, o, now);
+                if(o->nconns == 0 && o->nwaiting == 0)
+                {
+                    *pp = o->next;
+                    Free(o->host);
+                    Free(o);
+                }
+                else
+                    pp = &o->next;
+            }
+            pthread_mutex_unlock(&locks[b % UPSTREAM_LOCKS]);
+        }
+    }
+    return NULL;
+}
+
+// An idle connection must have nothing to read: EOF means server closed it,
+// data would be garbage from an earlier response
+static int is_alive(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,30 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+#define UPSTREAM_BUCKETS 256        // hash buckets of origins, power of 2
+#define UPSTREAM_LOCKS 16           // bucket i is guarded by lock i % UPSTREAM_LOCKS
+#define UPSTREAM_MAX_IDLE 8         // idle connections kept per origin
+#define UPSTREAM_MAX_CONNS 64       // connections open per origin, idle or busy
+#define UPSTREAM_IDLE_TIMEOUT 15    // seconds an idle connection is trusted
+#define UPSTREAM_SWEEP 5            // seconds between sweeps of all origins
+
+// Set up pool and start the thread that closes connections idle too long
+// and forgets origins with none open
+void Upstream_init();
+
+// Connection to server at <host, port>: an idle pooled one if there is a
+// live one, *reused_p tells which. Once the origin has UPSTREAM_MAX_CONNS
+// open, waits for one to be handed back or closed. Returns < 0 like
+// Open_clientfd
+int Upstream_get(char *host, int port, int *reused_p);
+
+// Hand back a connection whose last response was read completely, so that
+// it can carry the next request to the same server
+void Upstream_put(char *host, int port, int fd);
+
+// Close a connection from Upstream_get that can not be handed back
+void Upstream_close(char *host, int port, int fd);
+
+#endif /* __UPSTREAM_H__ */